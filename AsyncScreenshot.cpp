@@ -0,0 +1,145 @@
+#include "AsyncScreenshot.hpp"
+
+#include "load_save_png.hpp"
+#include "gl_errors.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+AsyncScreenshot::AsyncScreenshot() {
+	worker = std::thread(&AsyncScreenshot::work, this);
+}
+
+AsyncScreenshot::~AsyncScreenshot() {
+	finish();
+}
+
+void AsyncScreenshot::capture(std::string const &filename, glm::uvec2 const &size, GLenum read_buffer) {
+	if (!worker.joinable()) {
+		throw std::runtime_error("AsyncScreenshot::capture called after finish().");
+	}
+
+	Pending capture;
+	capture.filename = filename;
+	capture.size = size;
+
+	if (!free_buffers.empty()) {
+		capture.buffer = free_buffers.back();
+		free_buffers.pop_back();
+	} else {
+		glGenBuffers(1, &capture.buffer);
+	}
+
+	//with a buffer bound to GL_PIXEL_PACK_BUFFER, glReadPixels just queues a copy into it (rather than waiting for the GPU to catch up):
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffer);
+	glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(glm::u8vec4) * size.x * size.y, nullptr, GL_STREAM_READ);
+	cached_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glReadBuffer(read_buffer);
+	glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, nullptr); //(offset 0 in the bound buffer)
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	capture.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	pending.emplace_back(std::move(capture));
+
+	GL_ERRORS();
+}
+
+void AsyncScreenshot::update() {
+	//captures finish in the order they were started, so stop at the first one that isn't done:
+	size_t done = 0;
+	while (done < pending.size()) {
+		GLenum status = glClientWaitSync(pending[done].fence, 0, 0);
+		if (!(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)) break;
+		hand_off(std::move(pending[done]));
+		++done;
+	}
+	pending.erase(pending.begin(), pending.begin() + done);
+}
+
+void AsyncScreenshot::finish() {
+	if (!worker.joinable()) return; //already finished
+
+	//wait for the remaining readbacks:
+	for (auto &capture : pending) {
+		while (true) {
+			GLenum status = glClientWaitSync(capture.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000); //(timeout in nanoseconds)
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) break;
+			if (status == GL_WAIT_FAILED) {
+				std::cerr << "WARNING: failed to wait for screenshot '" << capture.filename << "'." << std::endl;
+				break;
+			}
+		}
+		hand_off(std::move(capture));
+	}
+	pending.clear();
+
+	//let the worker save whatever is left in the queue, then stop:
+	{
+		std::unique_lock< std::mutex > lock(jobs_mutex);
+		quit = true;
+	}
+	jobs_cv.notify_one();
+	worker.join();
+
+	if (!free_buffers.empty()) {
+		glDeleteBuffers(GLsizei(free_buffers.size()), free_buffers.data());
+		free_buffers.clear();
+	}
+}
+
+void AsyncScreenshot::hand_off(Pending &&capture) {
+	Job job;
+	job.filename = std::move(capture.filename);
+	job.size = capture.size;
+	job.data.resize(size_t(job.size.x) * job.size.y);
+
+	const GLsizeiptr bytes = sizeof(glm::u8vec4) * job.data.size();
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.buffer);
+	void const *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+	if (mapped) {
+		std::memcpy(job.data.data(), mapped, bytes);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	} else {
+		glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, bytes, job.data.data());
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	glDeleteSync(capture.fence);
+	capture.fence = 0;
+	free_buffers.emplace_back(capture.buffer);
+	capture.buffer = 0;
+
+	{
+		std::unique_lock< std::mutex > lock(jobs_mutex);
+		jobs.emplace_back(std::move(job));
+	}
+	jobs_cv.notify_one();
+
+	GL_ERRORS();
+}
+
+void AsyncScreenshot::work() {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock< std::mutex > lock(jobs_mutex);
+			jobs_cv.wait(lock, [this](){ return quit || !jobs.empty(); });
+			if (jobs.empty()) return; //(only happens once quit is set)
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		//the framebuffer's alpha channel isn't meaningful, so make the image opaque:
+		for (auto &px : job.data) {
+			px.a = 0xff;
+		}
+
+		try {
+			save_png(job.filename, job.size, job.data.data(), LowerLeftOrigin);
+		} catch (std::exception const &e) {
+			std::cerr << "WARNING: failed to save screenshot '" << job.filename << "': " << e.what() << std::endl;
+		}
+	}
+}
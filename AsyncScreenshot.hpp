@@ -0,0 +1,65 @@
+#pragma once
+
+#include "GL.hpp"
+
+#include <glm/glm.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Screenshots that don't stall the render thread:
+ *  - capture() starts reading the framebuffer into a pixel buffer object and returns right away;
+ *  - update() (call once per frame) maps captures whose readback the GPU has finished (usually a frame or two later);
+ *  - a worker thread does the alpha fixup and PNG encoding (via save_png).
+ */
+
+struct AsyncScreenshot {
+	AsyncScreenshot();
+	~AsyncScreenshot(); //calls finish()
+
+	//start reading back the lower-left 'size' pixels of 'read_buffer' of the default framebuffer, to be saved as 'filename':
+	void capture(std::string const &filename, glm::uvec2 const &size, GLenum read_buffer = GL_FRONT);
+
+	//hand any captures whose readback has finished to the worker thread (never waits for the GPU):
+	void update();
+
+	//wait for every capture to be read back and saved, then stop the worker and free GL objects:
+	// (call this while the GL context still exists -- e.g., before SDL_GL_DeleteContext)
+	void finish();
+
+	//------ internals ------
+
+	//a readback that the GPU may still be working on:
+	struct Pending {
+		std::string filename;
+		glm::uvec2 size = glm::uvec2(0);
+		GLuint buffer = 0; //pixel buffer object being read into
+		GLsync fence = 0; //signaled once the readback is done
+	};
+	std::vector< Pending > pending;
+
+	//pixel buffer objects that aren't being read into (kept around so periodic captures don't re-create them):
+	std::vector< GLuint > free_buffers;
+
+	//copy a finished readback out of its buffer and queue it for the worker:
+	void hand_off(Pending &&capture);
+
+	//pixels waiting to be saved by the worker:
+	struct Job {
+		std::string filename;
+		glm::uvec2 size = glm::uvec2(0);
+		std::vector< glm::u8vec4 > data;
+	};
+	std::mutex jobs_mutex;
+	std::condition_variable jobs_cv;
+	std::deque< Job > jobs; //guarded by jobs_mutex
+	bool quit = false; //guarded by jobs_mutex
+
+	std::thread worker;
+	void work();
+};
@@ -298,6 +298,8 @@ void init_GL() {
 	DO(glVertexAttribP3uiv)
 	DO(glVertexAttribP4ui)
 	DO(glVertexAttribP4uiv)
+
+	invalidate_GL_state(); //(a new context means all-new state)
 }
 #ifdef _WIN32
 	 void (APIENTRYFP glDrawRangeElements) (GLenum mode, GLuint start, GLuint end, GLsizei count, GLenum type, const void *indices);
@@ -584,3 +586,165 @@ void init_GL() {
 	 void (APIENTRYFP glVertexAttribP4ui) (GLuint index, GLenum type, GLboolean normalized, GLuint value);
 	 void (APIENTRYFP glVertexAttribP4uiv) (GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 #endif
+
+//------------ GL state cache ------------
+
+namespace {
+	//stands for "don't know what is bound" (GL never hands out this name):
+	constexpr GLuint Unknown = ~GLuint(0);
+
+	//texture units and targets whose bindings are cached (binds to other units or targets always go through):
+	constexpr uint32_t CachedTextureUnits = 16; //(the number GL 3.3 guarantees for each shader stage)
+	constexpr GLenum CachedTextureTargets[] = { GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_3D, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_RECTANGLE, GL_TEXTURE_BUFFER };
+	constexpr uint32_t CachedTextureTargetCount = sizeof(CachedTextureTargets) / sizeof(CachedTextureTargets[0]);
+
+	//capabilities whose enabled-ness is cached (other capabilities always go through):
+	constexpr GLenum CachedCapabilities[] = { GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_SCISSOR_TEST };
+	constexpr uint32_t CachedCapabilityCount = sizeof(CachedCapabilities) / sizeof(CachedCapabilities[0]);
+
+	struct GLStateCache {
+		GLuint program;
+		GLuint vertex_array;
+		GLuint draw_framebuffer;
+		GLuint read_framebuffer;
+		GLuint active_texture_unit;
+		GLuint textures[CachedTextureUnits][CachedTextureTargetCount];
+		int8_t capabilities[CachedCapabilityCount]; //-1 = unknown, 0 = disabled, 1 = enabled
+		GLenum blend_equation;
+		GLenum blend_sfactor, blend_dfactor;
+		bool viewport_known;
+		GLint viewport[4];
+
+		GLStateCache() { forget(); }
+		void forget() {
+			program = Unknown;
+			vertex_array = Unknown;
+			draw_framebuffer = Unknown;
+			read_framebuffer = Unknown;
+			active_texture_unit = Unknown;
+			for (auto &unit : textures) {
+				for (auto &texture : unit) texture = Unknown;
+			}
+			for (auto &capability : capabilities) capability = -1;
+			blend_equation = Unknown;
+			blend_sfactor = blend_dfactor = Unknown;
+			viewport_known = false;
+		}
+	} cache;
+
+	//index of target in CachedTextureTargets (or CachedTextureTargetCount if not cached):
+	uint32_t texture_target_index(GLenum target) {
+		uint32_t index = 0;
+		while (index < CachedTextureTargetCount && CachedTextureTargets[index] != target) ++index;
+		return index;
+	}
+
+	//the cached state of capability cap (or nullptr if not cached):
+	int8_t *capability_state(GLenum cap) {
+		for (uint32_t i = 0; i < CachedCapabilityCount; ++i) {
+			if (CachedCapabilities[i] == cap) return &cache.capabilities[i];
+		}
+		return nullptr;
+	}
+}
+
+void invalidate_GL_state() {
+	cache.forget();
+}
+
+void cached_glUseProgram(GLuint program) {
+	if (cache.program == program) return;
+	glUseProgram(program);
+	cache.program = program;
+}
+
+void cached_glBindVertexArray(GLuint array) {
+	if (cache.vertex_array == array) return;
+	glBindVertexArray(array);
+	cache.vertex_array = array;
+}
+
+void cached_glBindFramebuffer(GLenum target, GLuint framebuffer) {
+	if (target == GL_DRAW_FRAMEBUFFER) {
+		if (cache.draw_framebuffer == framebuffer) return;
+		glBindFramebuffer(target, framebuffer);
+		cache.draw_framebuffer = framebuffer;
+	} else if (target == GL_READ_FRAMEBUFFER) {
+		if (cache.read_framebuffer == framebuffer) return;
+		glBindFramebuffer(target, framebuffer);
+		cache.read_framebuffer = framebuffer;
+	} else {
+		if (cache.draw_framebuffer == framebuffer && cache.read_framebuffer == framebuffer) return;
+		glBindFramebuffer(target, framebuffer);
+		cache.draw_framebuffer = cache.read_framebuffer = framebuffer;
+	}
+}
+
+GLuint cached_framebuffer_binding(GLenum target) {
+	GLuint &cached = (target == GL_READ_FRAMEBUFFER ? cache.read_framebuffer : cache.draw_framebuffer);
+	if (cached == Unknown) {
+		GLint binding = 0;
+		glGetIntegerv(target == GL_READ_FRAMEBUFFER ? GL_READ_FRAMEBUFFER_BINDING : GL_DRAW_FRAMEBUFFER_BINDING, &binding);
+		cached = GLuint(binding);
+	}
+	return cached;
+}
+
+void cached_glActiveTexture(GLenum texture) {
+	GLuint unit = texture - GL_TEXTURE0;
+	if (cache.active_texture_unit == unit) return;
+	glActiveTexture(texture);
+	cache.active_texture_unit = unit;
+}
+
+void cached_glBindTexture(GLenum target, GLuint texture) {
+	uint32_t index = texture_target_index(target);
+	if (cache.active_texture_unit >= CachedTextureUnits || index == CachedTextureTargetCount) {
+		//not something the cache keeps track of:
+		glBindTexture(target, texture);
+		return;
+	}
+	GLuint &cached = cache.textures[cache.active_texture_unit][index];
+	if (cached == texture) return;
+	glBindTexture(target, texture);
+	cached = texture;
+}
+
+void cached_glEnable(GLenum cap) {
+	int8_t *state = capability_state(cap);
+	if (state && *state == 1) return;
+	glEnable(cap);
+	if (state) *state = 1;
+}
+
+void cached_glDisable(GLenum cap) {
+	int8_t *state = capability_state(cap);
+	if (state && *state == 0) return;
+	glDisable(cap);
+	if (state) *state = 0;
+}
+
+void cached_glBlendEquation(GLenum mode) {
+	if (cache.blend_equation == mode) return;
+	glBlendEquation(mode);
+	cache.blend_equation = mode;
+}
+
+void cached_glBlendFunc(GLenum sfactor, GLenum dfactor) {
+	if (cache.blend_sfactor == sfactor && cache.blend_dfactor == dfactor) return;
+	glBlendFunc(sfactor, dfactor);
+	cache.blend_sfactor = sfactor;
+	cache.blend_dfactor = dfactor;
+}
+
+void cached_glViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+	if (cache.viewport_known
+	 && cache.viewport[0] == x && cache.viewport[1] == y
+	 && cache.viewport[2] == width && cache.viewport[3] == height) return;
+	glViewport(x, y, width, height);
+	cache.viewport_known = true;
+	cache.viewport[0] = x;
+	cache.viewport[1] = y;
+	cache.viewport[2] = width;
+	cache.viewport[3] = height;
+}
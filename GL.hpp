@@ -1277,3 +1277,28 @@ GLAPI void (APIENTRYFP glVertexAttribP4ui) (GLuint index, GLenum type, GLboolean
 GLAPI void (APIENTRYFP glVertexAttribP4uiv) (GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 
 }
+
+//------------ GL state cache ------------
+//Versions of a few state-setting calls that remember what they set and skip the GL call when nothing would change.
+// (some drivers charge quite a bit for redundant binds, and reading state back with glGet* can stall the pipeline)
+//
+//The cache starts out (and is reset by init_GL() to) "unknown", so the first call of each always goes through.
+//If you change any of this state with the plain gl* calls -- or delete an object that is currently bound --
+// call invalidate_GL_state() so the cache doesn't skip a call it shouldn't.
+
+void invalidate_GL_state();
+
+void cached_glUseProgram(GLuint program);
+void cached_glBindVertexArray(GLuint array);
+void cached_glBindFramebuffer(GLenum target, GLuint framebuffer); //GL_FRAMEBUFFER, GL_DRAW_FRAMEBUFFER, or GL_READ_FRAMEBUFFER
+void cached_glActiveTexture(GLenum texture);
+void cached_glBindTexture(GLenum target, GLuint texture); //(binds to the active texture unit, like glBindTexture)
+void cached_glEnable(GLenum cap);
+void cached_glDisable(GLenum cap);
+void cached_glBlendEquation(GLenum mode);
+void cached_glBlendFunc(GLenum sfactor, GLenum dfactor);
+void cached_glViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+//the framebuffer bound to GL_DRAW_FRAMEBUFFER or GL_READ_FRAMEBUFFER:
+// (only asks GL -- and caches the answer -- if the cache doesn't know)
+GLuint cached_framebuffer_binding(GLenum target);
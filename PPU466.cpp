@@ -4,10 +4,22 @@
 #include "GL.hpp"
 #include "gl_compile_program.hpp"
 #include "gl_errors.hpp"
+#include "tile_kernels.hpp"
+
+#include <SDL.h>
 
 #include <glm/gtc/type_ptr.hpp>
 
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef PPU466_CHECK_ALLOCATIONS
+#include "allocation_count.hpp"
+#include <string>
+#endif
 
 //In order to implement the PPU466 on modern graphics hardware, a fancy, special purpose tile-drawing shader is used:
 struct PPUTileProgram {
@@ -20,236 +32,845 @@ struct PPUTileProgram {
 	GLuint Position_vec2 = -1U;
 	GLuint TileCoord_ivec2 = -1U;
 	GLuint Palette_int = -1U;
+	GLuint Bank_int = -1U;
 
 	//Uniform (per-invocation variable) locations:
 	GLuint OBJECT_TO_CLIP_mat4 = -1U;
+	GLuint TILE_BITPLANES_bool = -1U;
 
 	//Textures bindings:
-	//TEXTURE0 - the tile table (as a 128x128 R8UI texture)
-	//TEXTURE1 - the palette table (as a 4x8 RGBA8 texture)
+	//TEXTURE0 - the tile table (as a 128x128xTileBanks R8UI array texture, or as 16x256xTileBanks R8UI raw bitplanes if TILE_BITPLANES is set)
+	//TEXTURE1 - the palette table (as a 4xPaletteCount RGBA8 texture)
 };
 
 //Initialize tile program and associated buffers:
 Load< PPUTileProgram > tile_program(LoadTagEarly); //will 'new PPUTileProgram()' by default
 
+//When the background is drawn in BackgroundMode::Tilemap, a second shader resolves tiles per-fragment:
+struct PPUTilemapProgram {
+	PPUTilemapProgram();
+	~PPUTilemapProgram();
+
+	GLuint program = 0;
+
+	//(no attributes -- the screen-sized quad is generated from gl_VertexID)
+
+	//Uniform (per-invocation variable) locations:
+	GLuint SCREEN_SIZE_vec2 = -1U;
+	GLuint BACKGROUND_OFFSET_ivec2 = -1U;
+	GLuint BACKGROUND_BANKS_int_array = -1U;
+	GLuint TILE_BITPLANES_bool = -1U;
+
+	//Textures bindings:
+	//TEXTURE0 - the tile table (as a 128x128xTileBanks R8UI array texture, or as 16x256xTileBanks R8UI raw bitplanes if TILE_BITPLANES is set)
+	//TEXTURE1 - the palette table (as a 4xPaletteCount RGBA8 texture)
+	//TEXTURE2 - the background (as a BackgroundWidth x BackgroundHeight R16UI texture)
+};
+
+Load< PPUTilemapProgram > tilemap_program(LoadTagEarly);
+
+//When sprites are drawn in SpriteMode::Instanced, a third shader builds sprite quads from per-instance data:
+struct PPUSpriteProgram {
+	PPUSpriteProgram();
+	~PPUSpriteProgram();
+
+	GLuint program = 0;
+
+	//Attribute (per-instance variable) locations:
+	GLuint SpritePosition_uvec2 = -1U;
+	GLuint SpriteTile_uvec2 = -1U;
+
+	//Uniform (per-invocation variable) locations:
+	GLuint OBJECT_TO_CLIP_mat4 = -1U;
+	GLuint PRIORITY_uint = -1U;
+	GLuint SPRITE_BANKS_int_array = -1U;
+	GLuint TILE_BITPLANES_bool = -1U;
+
+	//Textures bindings:
+	//TEXTURE0 - the tile table (as a 128x128xTileBanks R8UI array texture, or as 16x256xTileBanks R8UI raw bitplanes if TILE_BITPLANES is set)
+	//TEXTURE1 - the palette table (as a 4xPaletteCount RGBA8 texture)
+};
+
+Load< PPUSpriteProgram > sprite_program(LoadTagEarly);
+
+//vertex format for convenience:
+// (packed into 8 bytes: positions fit in 16 bits, and tile coordinates -- 0 through 128 -- palettes, and banks fit in 8)
+struct PPUTileVertex {
+	PPUTileVertex(glm::ivec2 const &Position_, glm::ivec2 const &TileCoord_, int32_t const &Palette_, int32_t const &Bank_)
+		: Position(Position_), TileCoord(TileCoord_), Palette(uint8_t(Palette_)), Bank(uint8_t(Bank_)) { }
+	//I generally make class members lowercase, but I make an exception here because
+	// I use uppercase for vertex attributes in shader programs and want to match.
+	glm::i16vec2 Position;
+	glm::u8vec2 TileCoord;
+	uint8_t Palette;
+	uint8_t Bank;
+};
+static_assert(sizeof(PPUTileVertex) == 8, "tile vertices are packed");
+
+//Tiles are drawn as quads of four vertices -- lower left, upper left, lower right, upper right -- that share
+// one static index buffer (which turns each quad into two triangles):
+struct PPUQuadIndices {
+	PPUQuadIndices();
+	~PPUQuadIndices();
+
+	//the most quads a single draw call can use (the index buffer holds 16-bit indices):
+	enum : uint32_t { QuadCapacity = 65536 / 4 };
+
+	//index buffer holding 0,1,2, 2,1,3 for the first quad, 4,5,6, 6,5,7 for the next, and so on:
+	// (draw calls pick out quads with a base vertex, so they always start at the beginning)
+	GLuint index_buffer = 0;
+};
+
+Load< PPUQuadIndices > quad_indices(LoadTagEarly);
+
+//classification of a PPU's tables, used to skip invisible background tiles and to draw opaque ones without blending:
+// (bit i of each mask corresponds to color index i)
+template< typename PPU >
+struct PPUColorClasses {
+	std::array< uint8_t, 16 * 16 * PPU::TileBanks > tile_colors; //color indices each tile uses
+	std::array< uint8_t, PPU::PaletteCount > palette_transparent_colors; //color indices each palette makes fully transparent
+	std::array< uint8_t, PPU::PaletteCount > palette_opaque_colors; //color indices each palette makes fully opaque
+
+	//note which color indices tile i uses, straight from its bitplanes:
+	void classify_tile(uint32_t i, PPU466Base::Tile const &tile) {
+		uint8_t used0 = 0, used1 = 0, used2 = 0, used3 = 0;
+		for (uint32_t y = 0; y < 8; ++y) {
+			used0 |= ~(tile.bit0[y] | tile.bit1[y]);
+			used1 |= tile.bit0[y] & ~tile.bit1[y];
+			used2 |= ~tile.bit0[y] & tile.bit1[y];
+			used3 |= tile.bit0[y] & tile.bit1[y];
+		}
+		tile_colors[i] = (used0 ? 0x1 : 0) | (used1 ? 0x2 : 0) | (used2 ? 0x4 : 0) | (used3 ? 0x8 : 0);
+	}
+
+	//note which color indices each palette makes fully transparent or fully opaque:
+	void classify_palettes(std::array< PPU466Base::Palette, PPU::PaletteCount > const &palette_table) {
+		for (uint32_t p = 0; p < palette_table.size(); ++p) {
+			uint8_t transparent = 0;
+			uint8_t opaque = 0;
+			for (uint32_t c = 0; c < 4; ++c) {
+				if (palette_table[p][c].a == 0x00) transparent |= (1 << c);
+				if (palette_table[p][c].a == 0xff) opaque |= (1 << c);
+			}
+			palette_transparent_colors[p] = transparent;
+			palette_opaque_colors[p] = opaque;
+		}
+	}
+};
+
+//Vertex ring slots are persistently mapped when the context has glBufferStorage (core in OpenGL 4.4, otherwise GL_ARB_buffer_storage):
+// it isn't in GL.hpp's OpenGL 3.3 list, so it is looked up at runtime (as gl_compile_program does for program binaries).
+// (define PPU466_NO_BUFFER_STORAGE to always use the map-per-upload path -- handy for checking it)
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRY *PPUBufferStorageFn)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+//returns glBufferStorage, or nullptr if the context doesn't have it:
+static PPUBufferStorageFn buffer_storage_function() {
+	#ifdef PPU466_NO_BUFFER_STORAGE
+	return nullptr;
+	#else
+	static PPUBufferStorageFn fn = [](){
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		bool core = (major > 4 || (major == 4 && minor >= 4));
+		if (!core && !SDL_GL_ExtensionSupported("GL_ARB_buffer_storage")) return PPUBufferStorageFn(nullptr);
+		return reinterpret_cast< PPUBufferStorageFn >(SDL_GL_GetProcAddress("glBufferStorage"));
+	}();
+	return fn;
+	#endif
+}
+
+//Offsets (in vertices) of the layers of one PPU's part of a list of quads:
+struct PPUQuadLayers {
+	size_t begin = 0;
+	size_t behind_sprites_end = 0; //[begin, behind_sprites_end) are the 'behind' sprites
+	size_t opaque_background_end = 0; //[behind_sprites_end, opaque_background_end) are the background tiles that don't need blending
+	size_t background_end = 0; //[opaque_background_end, background_end) are the rest of the background tiles
+	size_t end = 0; //[background_end, end) are the 'in front' sprites
+};
+
 //PPU data is streamed to the GPU (read: uploaded 'just in time') using a few buffers:
+// (each PPU configuration gets its own, sized for it at compile time)
+template< typename PPU >
 struct PPUDataStream {
 	PPUDataStream();
 	~PPUDataStream();
 
-	//vertex format for convenience:
-	struct Vertex {
-		Vertex(glm::ivec2 const &Position_, glm::ivec2 const &TileCoord_, int32_t const &Palette_)
-			: Position(Position_), TileCoord(TileCoord_), Palette(Palette_) { }
-		//I generally make class members lowercase, but I make an exception here because
-		// I use uppercase for vertex attributes in shader programs and want to match.
-		glm::ivec2 Position;
-		glm::ivec2 TileCoord;
-		int32_t Palette;
+	typedef PPUTileVertex Vertex;
+
+	//the most quad vertices PPU466::draw will ever build:
+	static constexpr size_t VertexCapacity = 4 * (PPU::VisibleBackgroundWidth * PPU::VisibleBackgroundHeight + PPU::SpriteCount);
+	static_assert(VertexCapacity / 4 <= PPUQuadIndices::QuadCapacity, "quad index buffer is large enough");
+
+	//vertex data is streamed through a ring of buffers, so the CPU can write the next frame's vertices
+	// while the GPU may still be reading the previous frame's:
+	// - with glBufferStorage, each slot is mapped once (persistent + coherent) and written directly;
+	// - otherwise, each upload maps the slot unsynchronized (or orphans it, if the GPU is still reading it)
+	enum : uint32_t { VertexRingSize = 3 };
+	struct VertexRingSlot {
+		//vertex buffer that will store data stream:
+		GLuint vertex_buffer = 0;
+
+		//persistent mapping of vertex_buffer (nullptr when glBufferStorage isn't available):
+		void *mapped = nullptr;
+
+		//vertex array object that maps tile program attributes to vertex storage:
+		GLuint vertex_buffer_for_tile_program = 0;
+
+		//fence placed after the last draw that read vertex_buffer (0 if none pending):
+		GLsync fence = 0;
 	};
+	mutable std::array< VertexRingSlot, VertexRingSize > vertex_ring;
+	mutable uint32_t vertex_ring_current = VertexRingSize - 1; //slot written by the most recent upload
 
-	//vertex buffer that will store data stream:
-	GLuint vertex_buffer = 0;
+	mutable PPU466Base::StreamStats stats;
 
-	//vertex array object that maps tile program attributes to vertex storage:
-	GLuint vertex_buffer_for_tile_program = 0;
+	//phase timing for PPU466::draw:
+	mutable PPU466Base::DrawTimings timings;
+
+	//GPU timestamps are recorded into a ring of query sets and read back a few frames later (only once available),
+	// so asking for them never stalls the pipeline:
+	enum : uint32_t { TimerRingSize = 4 };
+	struct TimerQuerySet {
+		//timestamps at: start of uploads, start of drawing, end of drawing:
+		std::array< GLuint, 3 > queries{{0, 0, 0}};
+		bool pending = false; //queries were issued but haven't been read back yet
+	};
+	mutable std::array< TimerQuerySet, TimerRingSize > timer_ring;
+	mutable uint32_t timer_ring_current = 0; //query set to use for the next frame
+
+	//scratch storage for the quads, reserved once so that PPU466::draw never allocates:
+	mutable std::vector< Vertex > quad_vertices;
+
+	//scratch storage for the on-screen part of the sprite list (only used in SpriteMode::Instanced), also reserved once:
+	mutable std::vector< typename PPU::Sprite > visible_sprites;
+
+	//buffer that will store the sprite list (only used in SpriteMode::Instanced):
+	GLuint sprite_buffer = 0;
+
+	//vertex array object that maps sprite program (per-instance) attributes to sprite storage:
+	GLuint sprite_buffer_for_sprite_program = 0;
 
 	//texture object that will store tile table:
 	GLuint tile_tex = 0;
 
 	//texture object that will store palette table:
 	GLuint palette_tex = 0;
+
+	//copies of the tables as they were last uploaded to tile_tex and palette_tex:
+	// (PPU466::draw compares against these so it only decodes + uploads what actually changed)
+	// (these are 'mutable' because the loaded data stream is const, but the upload cache is not)
+	mutable std::array< PPU466Base::Tile, 16 * 16 * PPU::TileBanks > uploaded_tile_table;
+	mutable std::array< PPU466Base::Palette, PPU::PaletteCount > uploaded_palette_table;
+	mutable bool uploaded_tables_valid = false; //false until the first full upload
+
+	//tile_tex contents as one 128 x 128 index image per bank (only the rows of changed tiles get rebuilt):
+	mutable std::array< uint8_t, 128 * 128 * PPU::TileBanks > tile_data;
+
+	//texture object that stores the tile table as raw bitplanes (only used in TileMode::Bitplanes):
+	// (one 16 x 256 layer per bank -- one row per tile, holding bit0 rows in texels 0-7 and bit1 rows in texels 8-15)
+	GLuint tile_bitplanes_tex = 0;
+
+	//tile mode that uploaded_tile_table was last uploaded with:
+	mutable PPU466Base::TileMode uploaded_tile_mode = PPU466Base::TileMode::Decoded;
+
+	//classification of the uploaded tables:
+	mutable PPUColorClasses< PPU > color_classes;
+
+	//texture object that will store the background (only used in BackgroundMode::Tilemap):
+	GLuint background_tex = 0;
+
+	//framebuffer (and its color storage) the screen is drawn to in OutputMode::Offscreen:
+	GLuint offscreen_framebuffer = 0;
+	GLuint offscreen_color = 0;
+
+	//copy of the background as it was last uploaded to background_tex:
+	mutable std::array< uint16_t, PPU::BackgroundWidth * PPU::BackgroundHeight > uploaded_background;
+	mutable bool uploaded_background_valid = false;
+
+	//PPU466::state_hash() of the state last drawn into offscreen_framebuffer:
+	mutable uint64_t offscreen_hash = 0;
+	mutable bool offscreen_valid = false;
+
+	//PPU466::state_hash() of the state whose vertices are in vertex_ring[vertex_ring_current] (and sprites are in sprite_buffer):
+	mutable uint64_t streamed_hash = 0;
+	mutable bool streamed_valid = false;
+
+	//layers of the quads in vertex_ring[vertex_ring_current] and the number of sprite instances in sprite_buffer:
+	// (so a frame that re-draws the streamed state doesn't need to rebuild either)
+	mutable PPUQuadLayers streamed_layers;
+	mutable size_t streamed_sprite_instances = 0;
 };
 
-Load< PPUDataStream > data_stream(LoadTagDefault);
+//Each configuration's streams are created the first time they are needed (rather than by a Load<> at startup),
+// so a program only pays for the configurations -- and for draw_batch -- that it actually draws with:
+// (like Load<>'ed resources, they then live until the program exits)
+template< typename Stream >
+Stream const *&stream_instance() {
+	static Stream const *instance = nullptr;
+	return instance;
+}
+
+template< typename Stream >
+Stream const *get_stream() {
+	Stream const *&instance = stream_instance< Stream >();
+	if (!instance) instance = new Stream();
+	return instance;
+}
+
+//PPU466::draw_batch draws several PPUs at once by packing their tables into shared textures and their quads into one shared buffer:
+template< typename PPU >
+struct PPUBatchStream {
+	PPUBatchStream();
+	~PPUBatchStream();
+
+	//upload cache for each PPU of the batch (slot i caches whichever PPU was i'th in the most recent batch):
+	struct Slot {
+		std::array< PPU466Base::Tile, 16 * 16 * PPU::TileBanks > uploaded_tile_table;
+		bool uploaded_tile_table_valid = false;
+		std::array< uint8_t, 128 * 128 * PPU::TileBanks > tile_data; //the slot's layers of its group's tile_tex
+		PPUColorClasses< PPU > color_classes;
+	};
+	mutable std::vector< Slot > slots;
+
+	//palettes of all the PPUs, as one image:
+	// PPU i's palettes are rows i * PaletteRows through i * PaletteRows + PaletteCount - 1,
+	// and row i * PaletteRows + PaletteCount is its background color (in all four entries)
+	enum : uint32_t { PaletteRows = PPU::PaletteCount + 1 };
+	mutable std::vector< glm::u8vec4 > palette_data;
+
+	//PPUs are drawn (and their tables stored) in groups small enough that:
+	// - each PPU's palette rows and banks -- counted from the group's first -- fit in PPUTileVertex's bytes, and
+	// - a group's tile layers fit in the 256 array texture layers that every OpenGL 3.3 implementation supports
+	enum : uint32_t { GroupSize = std::min(256 / uint32_t(PaletteRows), 256 / uint32_t(PPU::TileBanks)) };
+	static_assert(GroupSize * PPU::TileBanks <= 256, "a group's tile layers fit in GL 3.3's minimum GL_MAX_ARRAY_TEXTURE_LAYERS");
+
+	//textures for each group of PPUs (created as batches grow; never shrunk, so a smaller batch re-uses what's there):
+	struct Group {
+		//tile tables, as 128x128 R8UI layers (PPU j of the group has layers j * TileBanks and on):
+		GLuint tile_tex = 0;
+		//the group's part of palette_data, as a 4 x (GroupSize * PaletteRows) RGBA8 texture:
+		GLuint palette_tex = 0;
+		std::vector< glm::u8vec4 > uploaded_palette_data;
+	};
+	mutable std::vector< Group > groups;
+
+	//scratch storage for the combined quads, the layers each PPU's part of them is split into,
+	// and the ranges handed to glMultiDrawElementsBaseVertex:
+	mutable std::vector< PPUTileVertex > quad_vertices;
+	mutable std::vector< PPUQuadLayers > layers;
+	mutable std::vector< GLint > base_vertices;
+	mutable std::vector< GLsizei > counts;
+	mutable std::vector< void const * > index_offsets; //(always the start of the index buffer)
+
+	//vertex buffer (and tile program vertex array object) for the combined quads:
+	GLuint vertex_buffer = 0;
+	GLuint vertex_buffer_for_tile_program = 0;
+};
 
 //-------------------------------------------------------------------
 
-PPU466::PPU466() {
-	for (auto &palette : palette_table) {
-		palette[0] = glm::u8vec4(0x00, 0x00, 0x00, 0x00);
-		palette[1] = glm::u8vec4(0x44, 0x44, 0x44, 0xff);
-		palette[2] = glm::u8vec4(0x99, 0x99, 0x99, 0xff);
-		palette[3] = glm::u8vec4(0xff, 0xff, 0xff, 0xff);
+//the background pixel that lands at the lower left of a PPU's screen:
+// (background pixel (u,v) appears at screen pixel (u,v) + background_position, wrapped)
+template< typename PPU >
+glm::ivec2 background_lower_left_uv(PPU const &ppu) {
+	constexpr int32_t BackgroundWidthPixels = int32_t(PPU::BackgroundWidth) * 8;
+	constexpr int32_t BackgroundHeightPixels = int32_t(PPU::BackgroundHeight) * 8;
+	return glm::ivec2(
+		((-ppu.background_position.x % BackgroundWidthPixels) + BackgroundWidthPixels) % BackgroundWidthPixels,
+		((-ppu.background_position.y % BackgroundHeightPixels) + BackgroundHeightPixels) % BackgroundHeightPixels
+	);
+}
+
+//append a PPU's sprites (if with_sprites) and on-screen background tiles (if with_background) to a list of quads:
+// (positions are offset by origin, banks by first_bank, and palettes by first_palette, so several PPUs can share one list)
+template< typename PPU >
+PPUQuadLayers append_quads(PPU const &ppu, PPUColorClasses< PPU > const &color_classes, bool with_sprites, bool with_background,
+	glm::ivec2 const &origin, int32_t first_bank, int32_t first_palette, std::vector< PPUTileVertex > *quad_vertices_) {
+	assert(quad_vertices_);
+	auto &quad_vertices = *quad_vertices_;
+
+	PPUQuadLayers layers;
+	layers.begin = quad_vertices.size();
+
+	//helper to put a single tile somewhere on the screen:
+	// (the 'transform' bits are those of PPU466::Sprite::attributes -- they rotate and flip the tile)
+	auto draw_tile = [&](glm::ivec2 const &lower_left, uint8_t tile_index, uint8_t palette_index, uint8_t bank, uint8_t transform = 0){
+		//only the part of the tile that is on the screen gets a quad:
+		// (tiles can hang off the edges of the screen, and draw_batch draws screens right next to each other)
+		const int32_t x0 = std::max(0, -lower_left.x);
+		const int32_t y0 = std::max(0, -lower_left.y);
+		const int32_t x1 = std::min(8, int32_t(PPU::ScreenWidth) - lower_left.x);
+		const int32_t y1 = std::min(8, int32_t(PPU::ScreenHeight) - lower_left.y);
+		if (x0 >= x1 || y0 >= y1) return;
+
+		//convert tile index to lower-left pixel coordinate in tile image:
+		glm::ivec2 tile_coord = glm::ivec2((tile_index % 16)*8, (tile_index / 16)*8);
+
+		//rotating and flipping a tile just changes which pixel of the tile ends up at each pixel of the quad:
+		auto tile_coord_at = [&](int32_t x, int32_t y) {
+			if (transform & PPU466Base::SpriteFlipHorizontal) x = 8 - x;
+			if (transform & PPU466Base::SpriteFlipVertical) y = 8 - y;
+			if (transform & PPU466Base::SpriteRotate90) {
+				int32_t t = x;
+				x = 8 - y;
+				y = t;
+			}
+			return glm::ivec2(tile_coord.x + x, tile_coord.y + y);
+		};
+
+		int32_t palette = first_palette + palette_index;
+		int32_t layer = first_bank + bank;
+		glm::ivec2 at = origin + lower_left;
+
+		//build a quad (in the corner order PPUQuadIndices expects):
+		quad_vertices.emplace_back(glm::ivec2(at.x+x0, at.y+y0), tile_coord_at(x0,y0), palette, layer);
+		quad_vertices.emplace_back(glm::ivec2(at.x+x0, at.y+y1), tile_coord_at(x0,y1), palette, layer);
+		quad_vertices.emplace_back(glm::ivec2(at.x+x1, at.y+y0), tile_coord_at(x1,y0), palette, layer);
+		quad_vertices.emplace_back(glm::ivec2(at.x+x1, at.y+y1), tile_coord_at(x1,y1), palette, layer);
+	};
+
+	//helper to draw the sprite list (used because we need to draw the 'behind' sprites, then the background, then the 'front' sprites:
+	auto draw_sprites = [&](uint8_t priority) {
+		for (auto const &sprite : ppu.sprites) {
+			if (sprite.y >= PPU::ScreenHeight) continue; //off the screen
+			if ((sprite.attributes & 0x80) != priority) continue;
+			draw_tile(
+				glm::ivec2(sprite.x, sprite.y),
+				sprite.index,
+				sprite.attributes & (PPU::PaletteCount - 1), //just the palette index part
+				ppu.sprite_banks[(sprite.attributes & PPU466Base::SpriteBankSelect) ? 1 : 0], //bank selected by the bank select bit
+				sprite.attributes & (PPU466Base::SpriteFlipHorizontal | PPU466Base::SpriteFlipVertical | PPU466Base::SpriteRotate90) //just the transform part
+			);
+		}
+	};
+
+	if (with_sprites) {
+		draw_sprites(0x80); //draw sprites with priority == 1 ('behind' sprites)
 	}
+	layers.behind_sprites_end = quad_vertices.size();
+
+	//the background tiles that overlap the screen:
+	// (the screen is ScreenWidth x ScreenHeight pixels, so it can overlap at most one more tile than fits evenly in each direction)
+	const glm::ivec2 lower_left_uv = background_lower_left_uv(ppu);
+	const int32_t visible_columns = (int32_t(PPU::ScreenWidth) + lower_left_uv.x % 8 + 7) / 8;
+	const int32_t visible_rows = (int32_t(PPU::ScreenHeight) + lower_left_uv.y % 8 + 7) / 8;
+	assert(visible_columns <= int32_t(PPU::VisibleBackgroundWidth) && visible_rows <= int32_t(PPU::VisibleBackgroundHeight));
+
+	//helper to draw the background tiles that overlap the screen and are either opaque or not:
+	// (background tiles never overlap each other, so they can be drawn in any order)
+	auto draw_background = [&](bool opaque) {
+		//To simulate the 'infinite tiling' behavior this code walks just the tiles that overlap the screen,
+		// wrapping tile rows and columns around the edges of the background as needed.
+
+		for (int32_t y = 0; y < visible_rows; ++y) {
+			const int32_t row = (lower_left_uv.y / 8 + y) % int32_t(PPU::BackgroundHeight);
+			const int32_t screen_y = 8*y - lower_left_uv.y % 8;
+			for (int32_t x = 0; x < visible_columns; ++x) {
+				const int32_t column = (lower_left_uv.x / 8 + x) % int32_t(PPU::BackgroundWidth);
+				uint16_t info = ppu.background[column + PPU::BackgroundWidth * row];
+				uint8_t tile_index = info & 0xff; //extract tile index bits
+				uint8_t palette_index = (info >> 8) & (PPU::PaletteCount - 1); //extract palette index bits
+				uint8_t bank = ppu.background_banks[(info >> 11) & 0x07]; //extract bank select bits
+
+				uint8_t colors = color_classes.tile_colors[bank * 256 + tile_index];
+				//skip tiles that only use transparent colors:
+				if ((colors & ~color_classes.palette_transparent_colors[palette_index]) == 0) continue;
+				//tiles that only use opaque colors don't need blending:
+				if (((colors & ~color_classes.palette_opaque_colors[palette_index]) == 0) != opaque) continue;
+
+				draw_tile(glm::ivec2(8*x - lower_left_uv.x % 8, screen_y), tile_index, palette_index, bank);
+			}
+		}
+	};
 
-	for (auto &tile : tile_table) {
-		tile.bit0 = { 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0 };
-		tile.bit1 = { 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff };
+	if (with_background) { //draw the background:
+		draw_background(true);
+		layers.opaque_background_end = quad_vertices.size();
+		draw_background(false);
+	} else {
+		layers.opaque_background_end = quad_vertices.size();
 	}
+	layers.background_end = quad_vertices.size();
 
-	for (uint32_t i = 0; i < background.size(); ++i) {
-		background[i] = int16_t(
-			  (i % 8) << 8 //cycle through all palettes
-			| (i % palette_table.size()) //cycle through all tiles
-		);
+	if (with_sprites) {
+		draw_sprites(0x00); //draw sprites with priority == 0 ('in front' sprites)
+	}
+	layers.end = quad_vertices.size();
+
+	assert(layers.end - layers.begin <=
+		  (with_background ? 4 * size_t(visible_columns * visible_rows) : 0)
+		+ (with_sprites ? 4 * ppu.sprites.size() : 0)
+		&& "Quad count was bounded correctly.");
+
+	return layers;
+}
+
+//-------------------------------------------------------------------
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+PPU466Base::StreamStats const &BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::stream_stats() {
+	return get_stream< PPUDataStream< BasicPPU466 > >()->stats;
+}
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+PPU466Base::DrawTimings const &BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::draw_timings() {
+	return get_stream< PPUDataStream< BasicPPU466 > >()->timings;
+}
+
+//helper that times consecutive phases of a function on the CPU:
+// each call to end_phase() stores the time since the previous call (or since construction) to a value in milliseconds
+struct PhaseTimer {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	void end_phase(double *ms) {
+		auto now = std::chrono::steady_clock::now();
+		*ms = std::chrono::duration< double, std::milli >(now - start).count();
+		start = now;
 	}
+};
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+void BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::draw(glm::uvec2 const &drawable_size) const {
+	//the viewport is the whole drawable:
+	draw(glm::ivec2(0,0), drawable_size);
 }
 
-void PPU466::draw(glm::uvec2 const &drawable_size) const {
-	//this code does screen scaling by manipulating the viewport, so save old values:
-	GLint old_viewport[4];
-	glGetIntegerv(GL_VIEWPORT, old_viewport);
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+void BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::draw(glm::ivec2 const &viewport_lower_left, glm::uvec2 const &viewport_size) const {
+	//the data stream for this configuration of the PPU:
+	// (created by the first draw, which is why this comes before any other GL state is set up)
+	PPUDataStream< BasicPPU466 > const *data_stream = get_stream< PPUDataStream< BasicPPU466 > >();
 
-	//draw to whole drawable:
-	glViewport(0,0,drawable_size.x,drawable_size.y);
+	//draw to the whole viewport:
+	// (this code does screen scaling by manipulating the viewport; it is set back to the one passed in at the end)
+	cached_glViewport(viewport_lower_left.x, viewport_lower_left.y, viewport_size.x, viewport_size.y);
 
-	//background gets background color:
+	//viewport gets background color:
+	// (glClear ignores the viewport, so the scissor test keeps the clear inside it)
 	glClearColor(
 		background_color.r / 255.0f, 
 		background_color.g / 255.0f, 
 		background_color.b / 255.0f,
 		1.0f
 	);
+	cached_glEnable(GL_SCISSOR_TEST);
+	glScissor(viewport_lower_left.x, viewport_lower_left.y, viewport_size.x, viewport_size.y);
 	glClear(GL_COLOR_BUFFER_BIT);
+	cached_glDisable(GL_SCISSOR_TEST);
 
 	//set up screen scaling:
-	if (drawable_size.x < ScreenWidth || drawable_size.y < ScreenHeight) {
+	// (the screen ends up in the screen_size pixels starting at screen_lower_left in the drawable)
+	glm::ivec2 screen_lower_left = viewport_lower_left;
+	glm::ivec2 screen_size = glm::ivec2(viewport_size);
+	if (viewport_size.x < ScreenWidth || viewport_size.y < ScreenHeight) {
 		//if screen is too small, just do some inglorious pixel-mushing:
-		//(viewport is already set. nothing more to do.)
+		//(screen covers the whole viewport. nothing more to do.)
 	} else {
 		//otherwise, do careful integer-multiple upscaling:
-		//largest size that will fit in the drawable:
-		const uint32_t scale = std::max( 1U, std::min(drawable_size.x / ScreenWidth, drawable_size.y / ScreenHeight) );
+		//largest size that will fit in the viewport:
+		const uint32_t scale = std::max( 1U, std::min(viewport_size.x / ScreenWidth, viewport_size.y / ScreenHeight) );
 
-		//compute lower left so that screen is centered:
-		const glm::ivec2 lower_left = glm::ivec2(
-			(int32_t(drawable_size.x) - scale * int32_t(ScreenWidth)) / 2,
-			(int32_t(drawable_size.y) - scale * int32_t(ScreenHeight)) / 2
+		//compute lower left so that screen is centered in the viewport:
+		screen_lower_left = viewport_lower_left + glm::ivec2(
+			(int32_t(viewport_size.x) - scale * int32_t(ScreenWidth)) / 2,
+			(int32_t(viewport_size.y) - scale * int32_t(ScreenHeight)) / 2
 		);
-		glViewport(lower_left.x, lower_left.y, scale * ScreenWidth, scale * ScreenHeight);
+		screen_size = glm::ivec2(scale * ScreenWidth, scale * ScreenHeight);
 	}
 
-	//build triangle strip representing background and sprites:
+	auto &timings = data_stream->timings;
+	timings.frames += 1;
+	PhaseTimer phase_timer;
 
-	constexpr uint32_t TristripSize = uint32_t(6 * (BackgroundWidth * BackgroundHeight + decltype(sprites)().size()));
-	std::vector< PPUDataStream::Vertex > triangle_strip;
-	triangle_strip.reserve(TristripSize);
+	//menus and pause screens tend to draw the same state over and over, which this notices:
+	const uint64_t hash = state_hash();
 
-	//helper to put a single tile somewhere on the screen:
-	auto draw_tile = [&triangle_strip](glm::ivec2 const &lower_left, uint8_t tile_index, uint8_t palette_index){
-		//convert tile index to lower-left pixel coordinate in tile image:
-		glm::ivec2 tile_coord = glm::ivec2((tile_index % 16)*8, (tile_index / 16)*8);
+	GLuint old_draw_framebuffer = 0;
+	if (output_mode == OutputMode::Offscreen) {
+		old_draw_framebuffer = cached_framebuffer_binding(GL_DRAW_FRAMEBUFFER);
+	}
 
-		//build a quad as a (very short) triangle strip that starts and ends with degenerate triangles:
-		triangle_strip.emplace_back(glm::ivec2(lower_left.x+0, lower_left.y+0), glm::ivec2(tile_coord.x+0, tile_coord.y+0), palette_index);
-		triangle_strip.emplace_back(triangle_strip.back());
-		triangle_strip.emplace_back(glm::ivec2(lower_left.x+0, lower_left.y+8), glm::ivec2(tile_coord.x+0, tile_coord.y+8), palette_index);
-		triangle_strip.emplace_back(glm::ivec2(lower_left.x+8, lower_left.y+0), glm::ivec2(tile_coord.x+8, tile_coord.y+0), palette_index);
-		triangle_strip.emplace_back(glm::ivec2(lower_left.x+8, lower_left.y+8), glm::ivec2(tile_coord.x+8, tile_coord.y+8), palette_index);
-		triangle_strip.emplace_back(triangle_strip.back());
+	//helper to scale the offscreen image into the drawable with a single blit:
+	auto blit_offscreen = [&]() {
+		GLuint old_read_framebuffer = cached_framebuffer_binding(GL_READ_FRAMEBUFFER);
+		cached_glBindFramebuffer(GL_READ_FRAMEBUFFER, data_stream->offscreen_framebuffer);
+		cached_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, old_draw_framebuffer);
+		glBlitFramebuffer(
+			0, 0, ScreenWidth, ScreenHeight,
+			screen_lower_left.x, screen_lower_left.y, screen_lower_left.x + screen_size.x, screen_lower_left.y + screen_size.y,
+			GL_COLOR_BUFFER_BIT, GL_NEAREST
+		);
+		cached_glBindFramebuffer(GL_READ_FRAMEBUFFER, old_read_framebuffer);
 	};
 
-	//helper to draw the sprite list (used because we need to draw the 'behind' sprites, then the background, then the 'front' sprites:
-	auto draw_sprites = [this,&draw_tile](uint8_t priority) {
-		for (auto const &sprite : sprites) {
-			if ((sprite.attributes & 0x80) != priority) continue;
-			draw_tile(
-				glm::ivec2(sprite.x, sprite.y),
-				sprite.index,
-				sprite.attributes & 0x07 //just the palette index part
-			);
+	if (output_mode == OutputMode::Offscreen && data_stream->offscreen_valid && data_stream->offscreen_hash == hash) {
+		//the offscreen image already shows this state, so just show it again:
+		data_stream->stats.frames_reused += 1;
+		phase_timer.end_phase(&timings.decode);
+		timings.build = 0.0;
+		timings.upload = 0.0;
+
+		blit_offscreen();
+		phase_timer.end_phase(&timings.draw);
+
+		GL_ERRORS();
+		return;
+	}
+
+	if (output_mode == OutputMode::Offscreen) {
+		//draw the screen at its native size; it gets scaled into the drawable at the end:
+		cached_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, data_stream->offscreen_framebuffer);
+		cached_glViewport(0, 0, ScreenWidth, ScreenHeight);
+		glClear(GL_COLOR_BUFFER_BIT);
+	} else {
+		cached_glViewport(screen_lower_left.x, screen_lower_left.y, screen_size.x, screen_size.y);
+	}
+
+	#ifdef PPU466_CHECK_ALLOCATIONS
+	const uint64_t allocations_before = allocation_count();
+	#endif
+
+	for (auto bank : background_banks) assert(bank < TileBanks && "background_banks entries must be valid tile banks");
+	for (auto bank : sprite_banks) assert(bank < TileBanks && "sprite_banks entries must be valid tile banks");
+
+	//if the current vertex ring slot (and sprite buffer) were filled from this exact state, they can just be drawn again:
+	// (the tables were uploaded along with them, so there is nothing to decode, build, or upload)
+	const bool reuse_vertices = data_stream->streamed_valid && data_stream->streamed_hash == hash;
+
+	constexpr uint32_t QuadVertexCount = uint32_t(4 * (VisibleBackgroundWidth * VisibleBackgroundHeight + SpriteCount));
+	//(re-uses storage owned by the data stream, so building the quads doesn't touch the heap)
+	auto &quad_vertices = data_stream->quad_vertices;
+	auto &visible_sprites = data_stream->visible_sprites;
+
+	bool palette_changed = false;
+	static_assert(16 * TileBanks <= 64, "tile strips fit in a 64-bit mask");
+	uint64_t changed_tile_strips = 0; //bit i set if strip i needs to be uploaded
+
+	if (reuse_vertices) {
+		data_stream->stats.uploads_skipped += 1;
+		phase_timer.end_phase(&timings.decode);
+		timings.build = 0.0;
+	} else {
+		//find what changed in the palette and tile tables since the last draw:
+		// (changed entries are re-classified and decoded here; they get uploaded to the GPU further down)
+
+		palette_changed = !data_stream->uploaded_tables_valid || palette_table != data_stream->uploaded_palette_table;
+		if (palette_changed) {
+			data_stream->uploaded_palette_table = palette_table;
+			data_stream->color_classes.classify_palettes(palette_table);
 		}
-	};
 
-	draw_sprites(0x80); //draw sprites with priority == 1 ('behind' sprites)
-
-	{ //draw the background:
-		//To simulate the 'infinite tiling' behavior this code draws the background as four screen-sized chunks,
-		// each of which is drawn at an offset that causes it to overlap the screen.
-
-		static_assert(BackgroundWidth * 8 == ScreenWidth * 2, "Background should be exactly twice the screen width.");
-		static_assert(BackgroundHeight * 8 == ScreenHeight * 2, "Background should be exactly twice the screen height.");
-
-		for (int32_t chunk_y : {0, int32_t(ScreenHeight)}) {
-			for (int32_t chunk_x : {0, int32_t(ScreenWidth)}) {
-				//position of the lower-left corner of the chunk:
-				glm::ivec2 pos = glm::ivec2(chunk_x, chunk_y) + background_position;
-
-				constexpr int32_t BackgroundWidthPixels = int32_t(BackgroundWidth) * 8;
-				constexpr int32_t BackgroundHeightPixels = int32_t(BackgroundHeight) * 8;
-
-				//reduce to (-BackgroundWidthPixels,0] x (-BackgroundHeightPixels,0]:
-				pos.x = ((pos.x % BackgroundWidthPixels) - BackgroundWidthPixels) % BackgroundWidthPixels;
-				pos.y = ((pos.y % BackgroundHeightPixels) - BackgroundHeightPixels) % BackgroundHeightPixels;
-
-				//move chunk if it doesn't overlap the screen:
-				if (pos.x + int32_t(ScreenWidth) <= 0) pos.x += BackgroundWidthPixels;
-				if (pos.y + int32_t(ScreenHeight) <= 0) pos.y += BackgroundHeightPixels;
-
-				int32_t ox = chunk_x / 8;
-				int32_t oy = chunk_y / 8;
-				for (int32_t y = 0; y < int32_t(BackgroundHeight)/2; ++y) {
-					for (int32_t x = 0; x < int32_t(BackgroundWidth)/2; ++x) {
-						uint16_t info = background[(x + ox) + BackgroundWidth * (y + oy)];
-						draw_tile(
-							glm::ivec2(pos.x + 8*x, pos.y + 8*y),
-							info & 0xff, //extract tile index bits
-							(info >> 8) & 0x07 //extract palette index bits
-						);
-					}
-				}
+		//tiles are uploaded in strips of 16 tiles (so each bank is 16 strips):
+		// (in TileMode::Decoded, a strip is 128 x 8 texels of the index texture; in TileMode::Bitplanes it is 16 x 16 texels of raw bitplanes)
+		const bool tiles_valid = data_stream->uploaded_tables_valid && data_stream->uploaded_tile_mode == tile_mode;
+		data_stream->uploaded_tile_mode = tile_mode;
+		for (uint32_t i = 0; i < tile_table.size(); ++i) {
+			Tile const &tile = tile_table[i];
+			Tile &uploaded = data_stream->uploaded_tile_table[i];
+			if (tiles_valid && tile.bit0 == uploaded.bit0 && tile.bit1 == uploaded.bit1) continue;
+			uploaded = tile;
+			changed_tile_strips |= (uint64_t(1) << (i / 16));
+
+			data_stream->color_classes.classify_tile(i, tile);
 
+			if (tile_mode == TileMode::Bitplanes) continue; //the GPU decodes raw bitplanes itself
+
+			//location of tile in the texture:
+			uint32_t ox = (i % 16) * 8;
+			uint32_t oy = ((i / 16) % 16) * 8;
+			uint32_t bank = i / 256;
+
+			//copy tile indices into texture:
+			tile_expand(tile, &data_stream->tile_data[128 * 128 * bank + ox + 128 * oy], 128);
+		}
+
+		data_stream->uploaded_tables_valid = true;
+
+		phase_timer.end_phase(&timings.decode);
+
+		//build quads representing background and sprites:
+
+		quad_vertices.clear();
+		assert(quad_vertices.capacity() >= QuadVertexCount && "Quad storage was reserved up front.");
+
+		data_stream->streamed_layers = append_quads(*this, data_stream->color_classes,
+			sprite_mode == SpriteMode::Tiles, background_mode == BackgroundMode::Tiles,
+			glm::ivec2(0,0), 0, 0, &quad_vertices);
+
+		visible_sprites.clear();
+		if (sprite_mode == SpriteMode::Instanced) {
+			//only on-screen sprites get instances:
+			for (auto const &sprite : sprites) {
+				if (sprite.y < ScreenHeight) visible_sprites.emplace_back(sprite);
 			}
 		}
+		data_stream->streamed_sprite_instances = visible_sprites.size();
+
+		#ifdef PPU466_CHECK_ALLOCATIONS
+		{ //after a few warm-up frames, building the frame should never allocate:
+			//(allocator churn in the draw path shows up as frame-time jitter)
+			//NOTE: only the CPU-side frame building is checked, since GL drivers are free to allocate internally
+			static uint32_t draws = 0;
+			draws += 1;
+			uint64_t allocations = allocation_count() - allocations_before;
+			if (draws > 3 && allocations != 0) {
+				throw std::runtime_error("PPU466::draw made " + std::to_string(allocations) + " heap allocation(s) in a steady-state frame.");
+			}
+		}
+		#endif
+
+		phase_timer.end_phase(&timings.build);
 	}
 
-	draw_sprites(0x00); //draw sprites with priority == 0 ('in front' sprites)
+	const size_t behind_sprites_end = data_stream->streamed_layers.behind_sprites_end;
+	const size_t opaque_background_end = data_stream->streamed_layers.opaque_background_end;
+	const size_t background_end = data_stream->streamed_layers.background_end;
+	const size_t quads_end = data_stream->streamed_layers.end;
+	const size_t sprite_instances = data_stream->streamed_sprite_instances;
 
-	assert(triangle_strip.size() == TristripSize && "Triangle strip size was estimated exactly.");
+	//(the tilemap program needs to know which background pixel lands at the lower left of the screen)
+	const glm::ivec2 lower_left_uv = background_lower_left_uv(*this);
 
 	//-------------------------------------------------
 	//Upload at to GPU using PPUDataStream:
 
-	{ //upload palette texture:
+	//read back the oldest set of GPU timestamps (if they're ready) and re-use it for this frame:
+	auto &timer_queries = data_stream->timer_ring[data_stream->timer_ring_current];
+	data_stream->timer_ring_current = (data_stream->timer_ring_current + 1) % PPUDataStream< BasicPPU466 >::TimerRingSize;
+	if (timer_queries.pending) {
+		//queries finish in order, so the last one being available means they all are:
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(timer_queries.queries.back(), GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			std::array< GLuint64, 3 > ns;
+			for (uint32_t i = 0; i < ns.size(); ++i) {
+				glGetQueryObjectui64v(timer_queries.queries[i], GL_QUERY_RESULT, &ns[i]);
+			}
+			timings.gpu_upload = (ns[1] - ns[0]) / 1.0e6;
+			timings.gpu_draw = (ns[2] - ns[1]) / 1.0e6;
+			timings.gpu_frames += 1;
+			timer_queries.pending = false;
+		}
+	}
+	//if the set is still in flight, this frame just doesn't get GPU timings (rather than waiting):
+	const bool record_timer_queries = !timer_queries.pending;
+	if (record_timer_queries) glQueryCounter(timer_queries.queries[0], GL_TIMESTAMP);
+
+	{ //upload palette texture (if it changed):
 		static_assert(sizeof(palette_table) == 4 * 4 * decltype(palette_table)().size(), "palette table is packed");
-		glBindTexture(GL_TEXTURE_2D, data_stream->palette_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4, GLsizei(palette_table.size()), 0, GL_RGBA, GL_UNSIGNED_BYTE, palette_table.data());
-		glBindTexture(GL_TEXTURE_2D, 0);
+		if (palette_changed) {
+			cached_glBindTexture(GL_TEXTURE_2D, data_stream->palette_tex);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, GLsizei(palette_table.size()), GL_RGBA, GL_UNSIGNED_BYTE, palette_table.data());
+		}
 	}
 
-	{ //build + upload tile table texture:
-		//interpret tiles and build a 128 x 128 index texture:
-		static std::array< uint8_t, 128 * 128 > data;
-		for (uint32_t i = 0; i < tile_table.size(); ++i) {
-			Tile const &tile = tile_table[i];
+	if (changed_tile_strips != 0) { //upload the parts of the tile table texture that changed:
+		static_assert(sizeof(tile_table) == 16 * decltype(tile_table)().size(), "tile table is packed");
+		cached_glBindTexture(GL_TEXTURE_2D_ARRAY, tile_mode == TileMode::Bitplanes ? data_stream->tile_bitplanes_tex : data_stream->tile_tex);
+		for (uint32_t strip = 0; strip < 16 * TileBanks; ++strip) {
+			if (!(changed_tile_strips & (uint64_t(1) << strip))) continue;
+			GLint bank = GLint(strip / 16);
+			GLint row = GLint(strip % 16);
+			if (tile_mode == TileMode::Bitplanes) {
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row * 16, bank, 16, 16, 1, GL_RED_INTEGER, GL_UNSIGNED_BYTE, &tile_table[strip * 16]);
+			} else {
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row * 8, bank, 128, 8, 1, GL_RED_INTEGER, GL_UNSIGNED_BYTE, data_stream->tile_data.data() + 128 * (strip * 8));
+			}
+		}
+	}
 
-			//location of tile in the texture:
-			uint32_t ox = (i % 16) * 8;
-			uint32_t oy = (i / 16) * 8;
+	if (!reuse_vertices && background_mode == BackgroundMode::Tilemap) { //upload background texture (if it changed):
+		if (!data_stream->uploaded_background_valid || background != data_stream->uploaded_background) {
+			cached_glBindTexture(GL_TEXTURE_2D, data_stream->background_tex);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, BackgroundWidth, BackgroundHeight, GL_RED_INTEGER, GL_UNSIGNED_SHORT, background.data());
+			data_stream->uploaded_background = background;
+			data_stream->uploaded_background_valid = true;
+		}
+	}
 
-			//copy tile indices into texture:
-			for (uint32_t y = 0; y < 8; ++y) {
-				for (uint32_t x = 0; x < 8; ++x) {
-					data[ox+x + 128 * (oy+y)] =
-						  ((tile.bit0[y] >> x) & 1)
-						| ((tile.bit1[y] >> x) & 1) << 1;
-				}
+	if (!reuse_vertices) { //upload vertex data to the next slot in the vertex ring:
+		static_assert(QuadVertexCount <= PPUDataStream< BasicPPU466 >::VertexCapacity, "vertex ring slots are large enough");
+		auto &ring = data_stream->vertex_ring;
+		auto &stats = data_stream->stats;
+		stats.uploads += 1;
+
+		//if the slot used last frame is still in flight, a single re-specified buffer would (at best) have been orphaned by the driver, or (at worst) stalled:
+		GLsync previous_fence = ring[data_stream->vertex_ring_current].fence;
+		if (previous_fence != 0) {
+			GLint status = GL_SIGNALED;
+			glGetSynciv(previous_fence, GL_SYNC_STATUS, 1, nullptr, &status);
+			if (status != GL_SIGNALED) stats.stalls_avoided += 1;
+		}
+
+		data_stream->vertex_ring_current = (data_stream->vertex_ring_current + 1) % PPUDataStream< BasicPPU466 >::VertexRingSize;
+		auto &slot = ring[data_stream->vertex_ring_current];
+
+		//check (but never wait) whether the GPU is done reading this slot:
+		bool slot_in_flight = false;
+		if (slot.fence != 0) {
+			GLenum status = glClientWaitSync(slot.fence, 0, 0);
+			slot_in_flight = !(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED);
+			if (slot_in_flight && slot.mapped) {
+				//persistently mapped storage can't be orphaned, so wait for the GPU to finish with it:
+				// (with three slots in the ring, this only happens when the GPU is more than two frames behind)
+				stats.waited += 1;
+				do {
+					status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000); //(timeout in nanoseconds)
+				} while (status == GL_TIMEOUT_EXPIRED);
 			}
+			glDeleteSync(slot.fence);
+			slot.fence = 0;
 		}
 
-		glBindTexture(GL_TEXTURE_2D, data_stream->tile_tex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, 128, 128, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, data.data());
-		glBindTexture(GL_TEXTURE_2D, 0);
+		GLsizeiptr size = sizeof(decltype(quad_vertices[0])) * quad_vertices.size();
+		if (slot.mapped) {
+			//(the mapping is coherent, so the writes are visible to the draw calls below without a flush)
+			std::memcpy(slot.mapped, quad_vertices.data(), size);
+		} else {
+			glBindBuffer(GL_ARRAY_BUFFER, slot.vertex_buffer);
+			GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+			if (slot_in_flight) {
+				//the GPU may still be reading this slot, so orphan its storage instead of waiting for it:
+				glBufferData(GL_ARRAY_BUFFER, sizeof(typename PPUDataStream< BasicPPU466 >::Vertex) * PPUDataStream< BasicPPU466 >::VertexCapacity, nullptr, GL_STREAM_DRAW);
+				access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+				stats.orphaned += 1;
+			}
+			if (size > 0) {
+				void *mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, access);
+				if (mapped) {
+					std::memcpy(mapped, quad_vertices.data(), size);
+					glUnmapBuffer(GL_ARRAY_BUFFER);
+				} else {
+					glBufferSubData(GL_ARRAY_BUFFER, 0, size, quad_vertices.data());
+				}
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
 	}
 
-	{ //upload vertex data:
-		glBindBuffer(GL_ARRAY_BUFFER, data_stream->vertex_buffer);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(decltype(triangle_strip[0])) * triangle_strip.size(), triangle_strip.data(), GL_STREAM_DRAW);
+	if (!reuse_vertices && sprite_mode == SpriteMode::Instanced && !visible_sprites.empty()) { //upload (on-screen part of) sprite list as per-instance data:
+		static_assert(sizeof(sprites) == sizeof(Sprite) * SpriteCount, "sprite list is packed");
+		glBindBuffer(GL_ARRAY_BUFFER, data_stream->sprite_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Sprite) * visible_sprites.size(), visible_sprites.data(), GL_STREAM_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
+	data_stream->streamed_hash = hash;
+	data_stream->streamed_valid = true;
+
+	phase_timer.end_phase(&timings.upload);
+	if (record_timer_queries) glQueryCounter(timer_queries.queries[1], GL_TIMESTAMP);
 
 	//set up the pipeline:
 	// set blending function for output fragments:
-	glEnable(GL_BLEND);
-	glBlendEquation(GL_FUNC_ADD);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-	// set the shader programs:
-	glUseProgram(tile_program->program);
-
-	// configure attribute streams:
-	glBindVertexArray(data_stream->vertex_buffer_for_tile_program);
+	cached_glEnable(GL_BLEND);
+	cached_glBlendEquation(GL_FUNC_ADD);
+	cached_glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	// set uniforms for shader programs:
 	{ //set matrix to transform [0,ScreenWidth]x[0,ScreenHeight] -> [-1,1]x[-1,1]:
@@ -260,31 +881,316 @@ void PPU466::draw(glm::uvec2 const &drawable_size) const {
 			glm::vec4(0.0f, 0.0f, 1.0f, 0.0f),
 			glm::vec4(-1.0f,-1.0f, 0.0f, 1.0f)
 		);
+		cached_glUseProgram(tile_program->program);
 		glUniformMatrix4fv(tile_program->OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(OBJECT_TO_CLIP));
+		glUniform1i(tile_program->TILE_BITPLANES_bool, tile_mode == TileMode::Bitplanes);
+		if (sprite_mode == SpriteMode::Instanced) {
+			cached_glUseProgram(sprite_program->program);
+			glUniformMatrix4fv(sprite_program->OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(OBJECT_TO_CLIP));
+			glUniform1i(sprite_program->TILE_BITPLANES_bool, tile_mode == TileMode::Bitplanes);
+			GLint banks[2] = { sprite_banks[0], sprite_banks[1] };
+			glUniform1iv(sprite_program->SPRITE_BANKS_int_array, 2, banks);
+		}
+	}
+	if (background_mode == BackgroundMode::Tilemap) {
+		cached_glUseProgram(tilemap_program->program);
+		glUniform1i(tilemap_program->TILE_BITPLANES_bool, tile_mode == TileMode::Bitplanes);
+		GLint banks[8];
+		for (uint32_t i = 0; i < 8; ++i) banks[i] = background_banks[i];
+		glUniform1iv(tilemap_program->BACKGROUND_BANKS_int_array, 8, banks);
+		glUniform2f(tilemap_program->SCREEN_SIZE_vec2, float(ScreenWidth), float(ScreenHeight));
+		//offset from screen pixels to background pixels, reduced to [0,BackgroundWidthPixels) x [0,BackgroundHeightPixels):
+		glUniform2i(tilemap_program->BACKGROUND_OFFSET_ivec2, lower_left_uv.x, lower_left_uv.y);
 	}
 
 	// bind texture units to proper texture objects:
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, data_stream->palette_tex);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, data_stream->tile_tex);
+	if (background_mode == BackgroundMode::Tilemap) {
+		cached_glActiveTexture(GL_TEXTURE2);
+		cached_glBindTexture(GL_TEXTURE_2D, data_stream->background_tex);
+	}
+	cached_glActiveTexture(GL_TEXTURE1);
+	cached_glBindTexture(GL_TEXTURE_2D, data_stream->palette_tex);
+	cached_glActiveTexture(GL_TEXTURE0);
+	cached_glBindTexture(GL_TEXTURE_2D_ARRAY, tile_mode == TileMode::Bitplanes ? data_stream->tile_bitplanes_tex : data_stream->tile_tex);
+
+	//helpers to draw some of the quads, the sprites, and the background:
+	auto draw_quads = [&](size_t begin, size_t end) {
+		if (begin == end) return;
+		cached_glUseProgram(tile_program->program);
+		cached_glBindVertexArray(data_stream->vertex_ring[data_stream->vertex_ring_current].vertex_buffer_for_tile_program);
+		glDrawElementsBaseVertex(GL_TRIANGLES, GLsizei(6 * (end - begin) / 4), GL_UNSIGNED_SHORT, nullptr, GLint(begin));
+	};
+
+	auto draw_sprite_layer = [&](uint8_t priority, size_t begin, size_t end) {
+		if (sprite_mode == SpriteMode::Tiles) {
+			draw_quads(begin, end);
+		} else if (sprite_instances != 0) {
+			cached_glUseProgram(sprite_program->program);
+			glUniform1ui(sprite_program->PRIORITY_uint, priority);
+			cached_glBindVertexArray(data_stream->sprite_buffer_for_sprite_program);
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(sprite_instances));
+		}
+	};
+
+	auto draw_background_layer = [&]() {
+		if (background_mode == BackgroundMode::Tiles) {
+			//opaque tiles just overwrite whatever is behind them:
+			if (behind_sprites_end != opaque_background_end) {
+				cached_glDisable(GL_BLEND);
+				draw_quads(behind_sprites_end, opaque_background_end);
+				cached_glEnable(GL_BLEND);
+			}
+			draw_quads(opaque_background_end, background_end);
+		} else {
+			//background as one screen-sized quad:
+			// (the tilemap program reads no attributes, so any vertex array object will do)
+			cached_glUseProgram(tilemap_program->program);
+			cached_glBindVertexArray(data_stream->vertex_ring[data_stream->vertex_ring_current].vertex_buffer_for_tile_program);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		}
+	};
+
+	//now that the pipeline is configured, trigger drawing:
+	if (background_mode == BackgroundMode::Tiles && sprite_mode == SpriteMode::Tiles && behind_sprites_end == opaque_background_end) {
+		//every quad needs blending, so one draw call does it:
+		draw_quads(0, quads_end);
+	} else {
+		draw_sprite_layer(0x80, 0, behind_sprites_end); //sprites behind the background
+		draw_background_layer();
+		draw_sprite_layer(0x00, background_end, quads_end); //sprites in front of the background
+	}
+
+	//mark the point at which the GPU will be done reading this frame's vertex ring slot:
+	// (a re-used slot already has a fence from the last draw that read it; this one replaces it)
+	GLsync &fence = data_stream->vertex_ring[data_stream->vertex_ring_current].fence;
+	if (fence != 0) glDeleteSync(fence);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	if (output_mode == OutputMode::Offscreen) {
+		//scale the screen into the drawable with a single blit:
+		blit_offscreen();
+		data_stream->offscreen_hash = hash;
+		data_stream->offscreen_valid = true;
+	}
+
+	if (record_timer_queries) {
+		glQueryCounter(timer_queries.queries[2], GL_TIMESTAMP);
+		timer_queries.pending = true;
+	}
+	phase_timer.end_phase(&timings.draw);
+
+	//the program, vertex array, textures, and blending are left as they are (the GL state cache makes re-binding them next frame free),
+	// but the viewport goes back to the one passed in:
+	cached_glViewport(viewport_lower_left.x, viewport_lower_left.y, viewport_size.x, viewport_size.y);
+
+	GL_ERRORS();
+}
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+void BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::draw_batch(std::vector< BasicPPU466 const * > const &ppus, glm::uvec2 const &drawable_size, uint32_t columns) {
+	assert(columns > 0 && "draw_batch needs at least one column");
+
+	//the batch stream for this configuration of the PPU:
+	PPUBatchStream< BasicPPU466 > const *batch = get_stream< PPUBatchStream< BasicPPU466 > >();
+	typedef PPUBatchStream< BasicPPU466 > BatchStream;
+
+	//clear the whole drawable (each PPU's screen gets its background color further down):
+	// (this code does screen scaling by manipulating the viewport; it is set back to the whole drawable at the end)
+	cached_glViewport(0,0,drawable_size.x,drawable_size.y);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	if (ppus.empty()) return;
 
-	//now that the pipeline is configured, trigger drawing of triangle strip:
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, GLsizei(triangle_strip.size()));
+	//the PPUs' screens are laid out in a grid, which is scaled just like a single screen is in draw():
+	const uint32_t count = uint32_t(ppus.size());
+	const uint32_t rows = (count + columns - 1) / columns;
+	const glm::uvec2 grid_size = glm::uvec2(columns * ScreenWidth, rows * ScreenHeight);
+	assert(grid_size.x <= 0x7fff && grid_size.y <= 0x7fff && "grid positions fit in PPUTileVertex's 16 bits");
+	if (drawable_size.x < grid_size.x || drawable_size.y < grid_size.y) {
+		//if the grid is too large, just do some inglorious pixel-mushing:
+		cached_glViewport(0, 0, drawable_size.x, drawable_size.y);
+	} else {
+		const uint32_t scale = std::max( 1U, std::min(drawable_size.x / grid_size.x, drawable_size.y / grid_size.y) );
+		cached_glViewport(
+			(int32_t(drawable_size.x) - scale * int32_t(grid_size.x)) / 2,
+			(int32_t(drawable_size.y) - scale * int32_t(grid_size.y)) / 2,
+			scale * grid_size.x,
+			scale * grid_size.y
+		);
+	}
+
+	//make sure every group of PPUs has textures:
+	// (groups are only ever added, so the ones already there keep their contents)
+	const uint32_t group_count = (count + BatchStream::GroupSize - 1) / BatchStream::GroupSize;
+	if (batch->slots.size() < count) batch->slots.resize(count);
+	while (batch->groups.size() < group_count) {
+		batch->groups.emplace_back();
+		auto &group = batch->groups.back();
+
+		glGenTextures(1, &group.tile_tex);
+		cached_glBindTexture(GL_TEXTURE_2D_ARRAY, group.tile_tex);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8UI, 128, 128, BatchStream::GroupSize * TileBanks, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+		//make the texture have sharp pixels when magnified:
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		//when access past the edge, clamp to the edge:
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &group.palette_tex);
+		cached_glBindTexture(GL_TEXTURE_2D, group.palette_tex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4, BatchStream::GroupSize * BatchStream::PaletteRows, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		//make the texture have sharp pixels when magnified:
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		//when access past the edge, clamp to the edge:
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
 
-	//return state to default:
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	//upload each PPU's changed tiles to its layers of its group's tile texture, and gather up all the palettes:
+	auto &palette_data = batch->palette_data;
+	palette_data.resize(4 * count * BatchStream::PaletteRows);
+	static_assert(16 * TileBanks <= 64, "tile strips fit in a 64-bit mask");
+	for (uint32_t i = 0; i < count; ++i) {
+		BasicPPU466 const &ppu = *ppus[i];
+		for (auto bank : ppu.background_banks) assert(bank < TileBanks && "background_banks entries must be valid tile banks");
+		for (auto bank : ppu.sprite_banks) assert(bank < TileBanks && "sprite_banks entries must be valid tile banks");
+
+		//as in draw(), tiles are uploaded in strips of 16 tiles (128 x 8 texels), and only strips with changed tiles get uploaded:
+		auto &slot = batch->slots[i];
+		uint64_t changed_tile_strips = 0; //bit i set if strip i needs to be uploaded
+		for (uint32_t t = 0; t < ppu.tile_table.size(); ++t) {
+			Tile const &tile = ppu.tile_table[t];
+			Tile &uploaded = slot.uploaded_tile_table[t];
+			if (slot.uploaded_tile_table_valid && tile.bit0 == uploaded.bit0 && tile.bit1 == uploaded.bit1) continue;
+			uploaded = tile;
+			changed_tile_strips |= (uint64_t(1) << (t / 16));
+			slot.color_classes.classify_tile(t, tile);
+			tile_expand(tile, &slot.tile_data[128 * 128 * (t / 256) + (t % 16) * 8 + 128 * ((t / 16) % 16) * 8], 128);
+		}
+		slot.uploaded_tile_table_valid = true;
+		if (changed_tile_strips != 0) {
+			cached_glBindTexture(GL_TEXTURE_2D_ARRAY, batch->groups[i / BatchStream::GroupSize].tile_tex);
+			const GLint first_layer = GLint((i % BatchStream::GroupSize) * TileBanks);
+			for (uint32_t strip = 0; strip < 16 * TileBanks; ++strip) {
+				if (!(changed_tile_strips & (uint64_t(1) << strip))) continue;
+				GLint bank = GLint(strip / 16);
+				GLint row = GLint(strip % 16);
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, row * 8, first_layer + bank, 128, 8, 1, GL_RED_INTEGER, GL_UNSIGNED_BYTE, slot.tile_data.data() + 128 * (strip * 8));
+			}
+		}
 
-	glBindVertexArray(0);
-	glUseProgram(0);
+		slot.color_classes.classify_palettes(ppu.palette_table);
+		glm::u8vec4 *rows = &palette_data[4 * i * BatchStream::PaletteRows];
+		for (uint32_t p = 0; p < PaletteCount; ++p) {
+			std::copy(ppu.palette_table[p].begin(), ppu.palette_table[p].end(), rows + 4 * p);
+		}
+		std::fill(rows + 4 * PaletteCount, rows + 4 * BatchStream::PaletteRows, glm::u8vec4(ppu.background_color, 0xff));
+	}
 
-	glDisable(GL_BLEND);
+	//upload each group's part of the palettes (if it changed):
+	for (uint32_t g = 0; g < group_count; ++g) {
+		auto &group = batch->groups[g];
+		auto begin = palette_data.begin() + 4 * g * BatchStream::GroupSize * BatchStream::PaletteRows;
+		auto end = palette_data.begin() + 4 * std::min(count, (g + 1) * BatchStream::GroupSize) * BatchStream::PaletteRows;
+		if (std::equal(begin, end, group.uploaded_palette_data.begin(), group.uploaded_palette_data.end())) continue;
+		cached_glBindTexture(GL_TEXTURE_2D, group.palette_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, GLsizei((end - begin) / 4), GL_RGBA, GL_UNSIGNED_BYTE, &*begin);
+		group.uploaded_palette_data.assign(begin, end);
+	}
 
-	//also restore viewport, since earlier scaling code messed with it:
-	glViewport(old_viewport[0], old_viewport[1], old_viewport[2], old_viewport[3]);
+	//build one list of quads holding every PPU's background color, sprites, and background tiles:
+	// (each PPU's palettes and banks are counted from the first of its group)
+	auto &quad_vertices = batch->quad_vertices;
+	auto &layers = batch->layers;
+	quad_vertices.clear();
+	layers.clear();
+	for (uint32_t i = 0; i < count; ++i) {
+		BasicPPU466 const &ppu = *ppus[i];
+
+		//screens are placed left-to-right, top-to-bottom:
+		const glm::ivec2 origin = glm::ivec2((i % columns) * ScreenWidth, (rows - 1 - i / columns) * ScreenHeight);
+
+		const int32_t first_bank = int32_t((i % BatchStream::GroupSize) * TileBanks);
+		const int32_t first_palette = int32_t((i % BatchStream::GroupSize) * BatchStream::PaletteRows);
+
+		//the background color is a screen-sized quad drawn with the PPU's background color row:
+		// (every entry of that row is the background color, so it doesn't matter which tile the quad shows)
+		const size_t begin = quad_vertices.size();
+		const int32_t background_color_row = first_palette + int32_t(PaletteCount);
+		quad_vertices.emplace_back(origin, glm::ivec2(0,0), background_color_row, first_bank);
+		quad_vertices.emplace_back(origin + glm::ivec2(0, ScreenHeight), glm::ivec2(0,0), background_color_row, first_bank);
+		quad_vertices.emplace_back(origin + glm::ivec2(ScreenWidth, 0), glm::ivec2(0,0), background_color_row, first_bank);
+		quad_vertices.emplace_back(origin + glm::ivec2(ScreenWidth, ScreenHeight), glm::ivec2(0,0), background_color_row, first_bank);
+
+		PPUQuadLayers ppu_layers = append_quads(ppu, batch->slots[i].color_classes, true, true,
+			origin, first_bank, first_palette, &quad_vertices);
+		ppu_layers.begin = begin; //(the background color goes with the 'behind' sprites)
+		layers.emplace_back(ppu_layers);
+	}
+
+	//upload all of the quads at once:
+	glBindBuffer(GL_ARRAY_BUFFER, batch->vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(PPUTileVertex) * quad_vertices.size(), quad_vertices.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//set up the pipeline:
+	cached_glBlendEquation(GL_FUNC_ADD);
+	cached_glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	{ //set matrix to transform the grid -- [0,grid_size.x]x[0,grid_size.y] -> [-1,1]x[-1,1]:
+		glm::mat4 OBJECT_TO_CLIP = glm::mat4(
+			glm::vec4(2.0f / grid_size.x, 0.0f, 0.0f, 0.0f),
+			glm::vec4(0.0f, 2.0f / grid_size.y, 0.0f, 0.0f),
+			glm::vec4(0.0f, 0.0f, 1.0f, 0.0f),
+			glm::vec4(-1.0f,-1.0f, 0.0f, 1.0f)
+		);
+		cached_glUseProgram(tile_program->program);
+		glUniformMatrix4fv(tile_program->OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(OBJECT_TO_CLIP));
+		glUniform1i(tile_program->TILE_BITPLANES_bool, GL_FALSE);
+	}
+
+	cached_glBindVertexArray(batch->vertex_buffer_for_tile_program);
+
+	//helper to draw the same layers of a group of PPUs with a single call:
+	// (screens don't overlap, so only the order of layers within each screen matters)
+	auto draw_layers = [&](uint32_t group_begin, uint32_t group_end, size_t PPUQuadLayers::*begin, size_t PPUQuadLayers::*end) {
+		auto &base_vertices = batch->base_vertices;
+		auto &counts = batch->counts;
+		base_vertices.clear();
+		counts.clear();
+		for (uint32_t i = group_begin; i < group_end; ++i) {
+			PPUQuadLayers const &ppu_layers = layers[i];
+			if (ppu_layers.*begin == ppu_layers.*end) continue;
+			base_vertices.emplace_back(GLint(ppu_layers.*begin));
+			counts.emplace_back(GLsizei(6 * (ppu_layers.*end - ppu_layers.*begin) / 4));
+		}
+		if (!base_vertices.empty()) {
+			batch->index_offsets.resize(base_vertices.size(), nullptr);
+			glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts.data(), GL_UNSIGNED_SHORT, batch->index_offsets.data(), GLsizei(base_vertices.size()), base_vertices.data());
+		}
+	};
+
+	for (uint32_t group_begin = 0; group_begin < count; group_begin += BatchStream::GroupSize) {
+		const uint32_t group_end = std::min(count, group_begin + BatchStream::GroupSize);
+		auto const &group = batch->groups[group_begin / BatchStream::GroupSize];
+		cached_glActiveTexture(GL_TEXTURE1);
+		cached_glBindTexture(GL_TEXTURE_2D, group.palette_tex);
+		cached_glActiveTexture(GL_TEXTURE0);
+		cached_glBindTexture(GL_TEXTURE_2D_ARRAY, group.tile_tex);
+
+		cached_glEnable(GL_BLEND);
+		draw_layers(group_begin, group_end, &PPUQuadLayers::begin, &PPUQuadLayers::behind_sprites_end); //background colors and 'behind' sprites
+		cached_glDisable(GL_BLEND);
+		draw_layers(group_begin, group_end, &PPUQuadLayers::behind_sprites_end, &PPUQuadLayers::opaque_background_end); //opaque background tiles
+		cached_glEnable(GL_BLEND);
+		draw_layers(group_begin, group_end, &PPUQuadLayers::opaque_background_end, &PPUQuadLayers::end); //other background tiles and 'in front' sprites
+	}
+
+	//as with draw(drawable_size), bindings are left as they are, but the viewport goes back to covering the whole drawable:
+	cached_glViewport(0, 0, drawable_size.x, drawable_size.y);
 
 	GL_ERRORS();
 }
@@ -293,6 +1199,43 @@ void PPU466::draw(glm::uvec2 const &drawable_size) const {
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+//All programs read the tile table through this function, which returns the color index at a pixel of the
+// 128x128 tile table image -- either by reading the decoded image or by decoding the raw bitplanes on the spot:
+#define PPU_TILE_INDEX_GLSL \
+	"uniform usampler2DArray TILE_TABLE;\n" \
+	"uniform bool TILE_BITPLANES;\n" \
+	"uint tile_index(ivec2 px, int bank) {\n" \
+	"	if (TILE_BITPLANES) {\n" \
+	"		int tile = (px.y / 8) * 16 + px.x / 8;\n" \
+	"		int x = px.x % 8;\n" \
+	"		int y = px.y % 8;\n" \
+	"		uint bit0 = texelFetch(TILE_TABLE, ivec3(y, tile, bank), 0).r;\n" /* row y of bit0 plane */ \
+	"		uint bit1 = texelFetch(TILE_TABLE, ivec3(8 + y, tile, bank), 0).r;\n" /* row y of bit1 plane */ \
+	"		return ((bit0 >> x) & 1u) | (((bit1 >> x) & 1u) << 1);\n" \
+	"	} else {\n" \
+	"		return texelFetch(TILE_TABLE, ivec3(px, bank), 0).r;\n" \
+	"	}\n" \
+	"}\n"
+
+//The tile and sprite programs share a fragment shader that looks up a color index in the tile table
+// and then a color in the palette table:
+static char const *TileFragmentShader =
+	"#version 330\n"
+	PPU_TILE_INDEX_GLSL
+	"uniform sampler2D PALETTE_TABLE;\n"
+	"in vec2 tileCoord;\n"
+	"flat in int palette;\n" //"flat" means "uses the value of the provoking [by default, last] vertex in the primitive"
+	"flat in int bank;\n"
+	"out vec4 fragColor;\n"
+	"void main() {\n"
+	"	uint index = tile_index(ivec2(tileCoord), bank);\n"
+	"	fragColor = texelFetch(PALETTE_TABLE, ivec2(index, palette % textureSize(PALETTE_TABLE, 0).y), 0);\n" //(only the low bits of the palette index are used when there are fewer than 8 palettes)
+	//"	fragColor = vec4(float(index)/4.0,float(palette)/8,1,1);\n"
+	//"	fragColor = texelFetch(TILE_TABLE, ivec2(int(gl_FragCoord.x) % textureSize(TILE_TABLE,0).x, int(gl_FragCoord.y) % textureSize(TILE_TABLE,0).y), 0);\n"
+	//"	fragColor = texelFetch(PALETTE_TABLE, ivec2(int(gl_FragCoord.x) % textureSize(PALETTE_TABLE,0).x, int(gl_FragCoord.y) % textureSize(PALETTE_TABLE,0).y), 0);\n"
+	"}\n"
+;
+
 PPUTileProgram::PPUTileProgram() {
 	program = gl_compile_program(
 		//vertex shader:
@@ -301,46 +1244,39 @@ PPUTileProgram::PPUTileProgram() {
 		"in vec4 Position;\n"
 		"in ivec2 TileCoord;\n"
 		"in int Palette;\n"
+		"in int Bank;\n"
 		"out vec2 tileCoord;\n"
 		"flat out int palette;\n"
+		"flat out int bank;\n"
 		"void main() {\n"
 		"	gl_Position = OBJECT_TO_CLIP * Position;\n"
 		"	tileCoord = TileCoord;\n"
 		"	palette = Palette;\n"
+		"	bank = Bank;\n"
 		"}\n"
 	,
 		//fragment shader:
-		"#version 330\n"
-		"uniform usampler2D TILE_TABLE;\n"
-		"uniform sampler2D PALETTE_TABLE;\n"
-		"in vec2 tileCoord;\n"
-		"flat in int palette;\n" //"flat" means "uses the value of the provoking [by default, last] vertex in the primitive"
-		"out vec4 fragColor;\n"
-		"void main() {\n"
-		"	uint index = texelFetch(TILE_TABLE, ivec2(tileCoord), 0).r;\n"
-		"	fragColor = texelFetch(PALETTE_TABLE, ivec2(index, palette), 0);\n"
-		//"	fragColor = vec4(float(index)/4.0,float(palette)/8,1,1);\n"
-		//"	fragColor = texelFetch(TILE_TABLE, ivec2(int(gl_FragCoord.x) % textureSize(TILE_TABLE,0).x, int(gl_FragCoord.y) % textureSize(TILE_TABLE,0).y), 0);\n"
-		//"	fragColor = texelFetch(PALETTE_TABLE, ivec2(int(gl_FragCoord.x) % textureSize(PALETTE_TABLE,0).x, int(gl_FragCoord.y) % textureSize(PALETTE_TABLE,0).y), 0);\n"
-		"}\n"
+		TileFragmentShader
 	);
 
 	//look up the locations of vertex attributes:
 	Position_vec2 = glGetAttribLocation(program, "Position");
 	TileCoord_ivec2 = glGetAttribLocation(program, "TileCoord");
 	Palette_int = glGetAttribLocation(program, "Palette");
+	Bank_int = glGetAttribLocation(program, "Bank");
 
 	//look up the locations of uniforms:
 	OBJECT_TO_CLIP_mat4 = glGetUniformLocation(program, "OBJECT_TO_CLIP");
+	TILE_BITPLANES_bool = glGetUniformLocation(program, "TILE_BITPLANES");
 
 	GLuint TILE_TABLE_usampler2D = glGetUniformLocation(program, "TILE_TABLE");
 	GLuint PALETTE_TABLE_sampler2D = glGetUniformLocation(program, "PALETTE_TABLE");
 
 	//bind texture units indices to samplers:
-	glUseProgram(program);
+	cached_glUseProgram(program);
 	glUniform1i(TILE_TABLE_usampler2D, 0);
 	glUniform1i(PALETTE_TABLE_sampler2D, 1);
-	glUseProgram(0);
+	cached_glUseProgram(0);
 
 	GL_ERRORS();
 }
@@ -348,32 +1284,157 @@ PPUTileProgram::PPUTileProgram() {
 PPUTileProgram::~PPUTileProgram() {
 	if (program != 0) {
 		glDeleteProgram(program);
+		invalidate_GL_state(); //(the program's name may be handed out again)
 		program = 0;
 	}
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+PPUSpriteProgram::PPUSpriteProgram() {
+	program = gl_compile_program(
+		//vertex shader:
+		"#version 330\n"
+		"uniform mat4 OBJECT_TO_CLIP;\n"
+		"uniform uint PRIORITY;\n"
+		"uniform int SPRITE_BANKS[2];\n"
+		"in uvec2 SpritePosition;\n" //x, y -- straight from BasicPPU466::Sprite
+		"in uvec2 SpriteTile;\n" //index, attributes -- straight from BasicPPU466::Sprite
+		"out vec2 tileCoord;\n"
+		"flat out int palette;\n"
+		"flat out int bank;\n"
+		"void main() {\n"
+		"	if ((SpriteTile.y & 0x80u) != PRIORITY) {\n" //not in this layer; collapse to a (culled) point
+		"		gl_Position = vec4(-2.0, -2.0, 0.0, 1.0);\n"
+		"		tileCoord = vec2(0.0);\n"
+		"		palette = 0;\n"
+		"		bank = 0;\n"
+		"		return;\n"
+		"	}\n"
+		"	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n" //(0,0), (1,0), (0,1), (1,1) -- a triangle strip
+		"	gl_Position = OBJECT_TO_CLIP * vec4(vec2(SpritePosition) + 8.0 * corner, 0.0, 1.0);\n"
+		//rotate (bit 5) and flip (bits 3 and 4) the tile by changing which tile corner lands at this quad corner:
+		"	vec2 tileCorner = corner;\n"
+		"	if ((SpriteTile.y & 0x08u) != 0u) tileCorner.x = 1.0 - tileCorner.x;\n"
+		"	if ((SpriteTile.y & 0x10u) != 0u) tileCorner.y = 1.0 - tileCorner.y;\n"
+		"	if ((SpriteTile.y & 0x20u) != 0u) tileCorner = vec2(1.0 - tileCorner.y, tileCorner.x);\n"
+		"	tileCoord = 8.0 * (vec2(SpriteTile.x % 16u, SpriteTile.x / 16u) + tileCorner);\n"
+		"	palette = int(SpriteTile.y & 0x7u);\n" //just the palette index part
+		"	bank = SPRITE_BANKS[(SpriteTile.y >> 6) & 0x1u];\n" //bank selected by the bank select bit
+		"}\n"
+	,
+		//fragment shader:
+		TileFragmentShader
+	);
 
-//PPU data is streamed to the GPU (read: uploaded 'just in time') using a few buffers:
-PPUDataStream::PPUDataStream() {
+	//look up the locations of vertex attributes:
+	SpritePosition_uvec2 = glGetAttribLocation(program, "SpritePosition");
+	SpriteTile_uvec2 = glGetAttribLocation(program, "SpriteTile");
 
-	//vertex_buffer_for_tile_program is a vertex array object that tells the GPU the layout of data in vertex_buffer:
-	glGenVertexArrays(1, &vertex_buffer_for_tile_program);
-	glBindVertexArray(vertex_buffer_for_tile_program);
+	//look up the locations of uniforms:
+	OBJECT_TO_CLIP_mat4 = glGetUniformLocation(program, "OBJECT_TO_CLIP");
+	PRIORITY_uint = glGetUniformLocation(program, "PRIORITY");
+	SPRITE_BANKS_int_array = glGetUniformLocation(program, "SPRITE_BANKS");
+	TILE_BITPLANES_bool = glGetUniformLocation(program, "TILE_BITPLANES");
 
-	//vertex_buffer will (eventually) hold vertex data for drawing:
-	glGenBuffers(1, &vertex_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	GLuint TILE_TABLE_usampler2D = glGetUniformLocation(program, "TILE_TABLE");
+	GLuint PALETTE_TABLE_sampler2D = glGetUniformLocation(program, "PALETTE_TABLE");
+
+	//bind texture units indices to samplers:
+	cached_glUseProgram(program);
+	glUniform1i(TILE_TABLE_usampler2D, 0);
+	glUniform1i(PALETTE_TABLE_sampler2D, 1);
+	cached_glUseProgram(0);
+
+	GL_ERRORS();
+}
+
+PPUSpriteProgram::~PPUSpriteProgram() {
+	if (program != 0) {
+		glDeleteProgram(program);
+		invalidate_GL_state(); //(the program's name may be handed out again)
+		program = 0;
+	}
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+PPUTilemapProgram::PPUTilemapProgram() {
+	program = gl_compile_program(
+		//vertex shader:
+		"#version 330\n"
+		"uniform vec2 SCREEN_SIZE;\n"
+		"out vec2 screenCoord;\n"
+		"void main() {\n"
+		"	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n" //(0,0), (1,0), (0,1), (1,1) -- a triangle strip covering the screen
+		"	gl_Position = vec4(2.0 * corner - 1.0, 0.0, 1.0);\n"
+		"	screenCoord = corner * SCREEN_SIZE;\n"
+		"}\n"
+	,
+		//fragment shader:
+		"#version 330\n"
+		PPU_TILE_INDEX_GLSL
+		"uniform sampler2D PALETTE_TABLE;\n"
+		"uniform usampler2D BACKGROUND;\n"
+		"uniform ivec2 BACKGROUND_OFFSET;\n"
+		"uniform int BACKGROUND_BANKS[8];\n"
+		"in vec2 screenCoord;\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		//background pixel under this fragment (offset is non-negative, so '%' wraps correctly):
+		"	ivec2 px = (ivec2(screenCoord) + BACKGROUND_OFFSET) % (textureSize(BACKGROUND, 0) * 8);\n"
+		"	uint info = texelFetch(BACKGROUND, px / 8, 0).r;\n"
+		"	uint tile = info & 0xffu;\n" //extract tile index bits
+		"	int palette = int((info >> 8) & 0x7u) % textureSize(PALETTE_TABLE, 0).y;\n" //extract palette index bits (only the low bits are used when there are fewer than 8 palettes)
+		"	int bank = BACKGROUND_BANKS[(info >> 11) & 0x7u];\n" //extract bank select bits
+		"	ivec2 tileCoord = ivec2(int(tile % 16u) * 8, int(tile / 16u) * 8) + px % 8;\n"
+		"	uint index = tile_index(tileCoord, bank);\n"
+		"	fragColor = texelFetch(PALETTE_TABLE, ivec2(index, palette), 0);\n"
+		"}\n"
+	);
+
+	//look up the locations of uniforms:
+	SCREEN_SIZE_vec2 = glGetUniformLocation(program, "SCREEN_SIZE");
+	BACKGROUND_OFFSET_ivec2 = glGetUniformLocation(program, "BACKGROUND_OFFSET");
+	BACKGROUND_BANKS_int_array = glGetUniformLocation(program, "BACKGROUND_BANKS");
+	TILE_BITPLANES_bool = glGetUniformLocation(program, "TILE_BITPLANES");
+
+	GLuint TILE_TABLE_usampler2D = glGetUniformLocation(program, "TILE_TABLE");
+	GLuint PALETTE_TABLE_sampler2D = glGetUniformLocation(program, "PALETTE_TABLE");
+	GLuint BACKGROUND_usampler2D = glGetUniformLocation(program, "BACKGROUND");
+
+	//bind texture units indices to samplers:
+	cached_glUseProgram(program);
+	glUniform1i(TILE_TABLE_usampler2D, 0);
+	glUniform1i(PALETTE_TABLE_sampler2D, 1);
+	glUniform1i(BACKGROUND_usampler2D, 2);
+	cached_glUseProgram(0);
+
+	GL_ERRORS();
+}
+
+PPUTilemapProgram::~PPUTilemapProgram() {
+	if (program != 0) {
+		glDeleteProgram(program);
+		invalidate_GL_state(); //(the program's name may be handed out again)
+		program = 0;
+	}
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+
+//Point the tile program's attributes at PPUTileVertex data in the buffer bound to GL_ARRAY_BUFFER, and attach the quad index buffer:
+// (both are recorded in the currently bound vertex array object)
+static void set_tile_program_attributes() {
 	//Notice how this binding is attaching an integer input to a floating point attribute:
 	glVertexAttribPointer(
 		tile_program->Position_vec2, //attribute
 		2, //size
-		GL_INT, //type
+		GL_SHORT, //type
 		GL_FALSE, //normalized
-		sizeof(Vertex), //stride
-		(GLbyte *)0 + offsetof(Vertex, Position) //offset
+		sizeof(PPUTileVertex), //stride
+		(GLbyte *)0 + offsetof(PPUTileVertex, Position) //offset
 	);
 	glEnableVertexAttribArray(tile_program->Position_vec2);
 
@@ -381,9 +1442,9 @@ PPUDataStream::PPUDataStream() {
 	glVertexAttribIPointer(
 		tile_program->TileCoord_ivec2, //attribute
 		2, //size
-		GL_INT, //type
-		sizeof(Vertex), //stride
-		(GLbyte *)0 + offsetof(Vertex, TileCoord) //offset
+		GL_UNSIGNED_BYTE, //type
+		sizeof(PPUTileVertex), //stride
+		(GLbyte *)0 + offsetof(PPUTileVertex, TileCoord) //offset
 	);
 	glEnableVertexAttribArray(tile_program->TileCoord_ivec2);
 
@@ -391,63 +1452,314 @@ PPUDataStream::PPUDataStream() {
 	glVertexAttribIPointer(
 		tile_program->Palette_int, //attribute
 		1, //size
-		GL_UNSIGNED_INT, //type
-		sizeof(Vertex), //stride
-		(GLbyte *)0 + offsetof(Vertex, Palette) //offset
+		GL_UNSIGNED_BYTE, //type
+		sizeof(PPUTileVertex), //stride
+		(GLbyte *)0 + offsetof(PPUTileVertex, Palette) //offset
 	);
 	glEnableVertexAttribArray(tile_program->Palette_int);
 
+	glVertexAttribIPointer(
+		tile_program->Bank_int, //attribute
+		1, //size
+		GL_UNSIGNED_BYTE, //type
+		sizeof(PPUTileVertex), //stride
+		(GLbyte *)0 + offsetof(PPUTileVertex, Bank) //offset
+	);
+	glEnableVertexAttribArray(tile_program->Bank_int);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_indices->index_buffer);
+}
+
+PPUQuadIndices::PPUQuadIndices() {
+	std::vector< uint16_t > indices;
+	indices.reserve(6 * QuadCapacity);
+	for (uint32_t quad = 0; quad < QuadCapacity; ++quad) {
+		uint16_t v = uint16_t(4 * quad);
+		//lower left, upper left, lower right; then lower right, upper left, upper right:
+		indices.insert(indices.end(), { v, uint16_t(v+1), uint16_t(v+2), uint16_t(v+2), uint16_t(v+1), uint16_t(v+3) });
+	}
+
+	//(the element array binding is vertex array state, so make sure the buffer doesn't end up attached to some other vertex array object)
+	cached_glBindVertexArray(0);
+	glGenBuffers(1, &index_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t) * indices.size(), indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	GL_ERRORS();
+}
+
+PPUQuadIndices::~PPUQuadIndices() {
+	if (index_buffer != 0) {
+		glDeleteBuffers(1, &index_buffer);
+		index_buffer = 0;
+	}
+}
+
+//PPU data is streamed to the GPU (read: uploaded 'just in time') using a few buffers:
+template< typename PPU >
+PPUDataStream< PPU >::PPUDataStream() {
+	quad_vertices.reserve(VertexCapacity);
+	visible_sprites.reserve(PPU::SpriteCount);
+
+	for (auto &slot : vertex_ring) {
+		//vertex_buffer_for_tile_program is a vertex array object that tells the GPU the layout of data in vertex_buffer:
+		glGenVertexArrays(1, &slot.vertex_buffer_for_tile_program);
+		cached_glBindVertexArray(slot.vertex_buffer_for_tile_program);
+
+		//vertex_buffer will (eventually) hold vertex data for drawing:
+		glGenBuffers(1, &slot.vertex_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, slot.vertex_buffer);
+		if (PPUBufferStorageFn BufferStorage = buffer_storage_function()) {
+			//allocate immutable storage and keep it mapped; PPU466::draw writes straight into it:
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			BufferStorage(GL_ARRAY_BUFFER, sizeof(Vertex) * VertexCapacity, nullptr, flags);
+			slot.mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * VertexCapacity, flags);
+			if (!slot.mapped) {
+				throw std::runtime_error("PPU466 failed to persistently map a vertex buffer.");
+			}
+		} else {
+			//allocate storage once; PPU466::draw maps and overwrites (part of) it every time it uses this slot:
+			glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * VertexCapacity, nullptr, GL_STREAM_DRAW);
+		}
+
+		set_tile_program_attributes();
+
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		cached_glBindVertexArray(0);
+	}
+
+
+	//sprite_buffer_for_sprite_program feeds the (raw) sprite list to the sprite program, one sprite per instance:
+	glGenVertexArrays(1, &sprite_buffer_for_sprite_program);
+	cached_glBindVertexArray(sprite_buffer_for_sprite_program);
+
+	glGenBuffers(1, &sprite_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, sprite_buffer);
+
+	//sprite positions are bytes or shorts, depending on the screen size:
+	glVertexAttribIPointer(
+		sprite_program->SpritePosition_uvec2, //attribute
+		2, //size
+		sizeof(typename PPU::SpriteCoordinate) == 1 ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT, //type
+		sizeof(typename PPU::Sprite), //stride
+		(GLbyte *)0 + offsetof(typename PPU::Sprite, x) //offset
+	);
+	glEnableVertexAttribArray(sprite_program->SpritePosition_uvec2);
+
+	glVertexAttribIPointer(
+		sprite_program->SpriteTile_uvec2, //attribute
+		2, //size
+		GL_UNSIGNED_BYTE, //type
+		sizeof(typename PPU::Sprite), //stride
+		(GLbyte *)0 + offsetof(typename PPU::Sprite, index) //offset
+	);
+	glEnableVertexAttribArray(sprite_program->SpriteTile_uvec2);
+
+	//advance to the next sprite once per instance (rather than once per vertex):
+	glVertexAttribDivisor(sprite_program->SpritePosition_uvec2, 1);
+	glVertexAttribDivisor(sprite_program->SpriteTile_uvec2, 1);
+
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	glBindVertexArray(0);
+	cached_glBindVertexArray(0);
 
 
 	glGenTextures(1, &tile_tex);
-	glBindTexture(GL_TEXTURE_2D, tile_tex);
+	cached_glBindTexture(GL_TEXTURE_2D_ARRAY, tile_tex);
 	//passing 'nullptr' to TexImage says "allocate memory but don't store anything there":
 	// (textures will be uploaded later)
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, 128, 128, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+	//one layer per tile bank:
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8UI, 128, 128, PPU::TileBanks, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+	//make the texture have sharp pixels when magnified:
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	//when access past the edge, clamp to the edge:
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	cached_glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+
+	glGenTextures(1, &tile_bitplanes_tex);
+	cached_glBindTexture(GL_TEXTURE_2D_ARRAY, tile_bitplanes_tex);
+	//one row of 16 bytes per tile (exactly the layout of PPU466::Tile), one layer per tile bank:
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8UI, 16, 256, PPU::TileBanks, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+	//make the texture have sharp pixels when magnified:
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	//when access past the edge, clamp to the edge:
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	cached_glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+
+	glGenTextures(1, &palette_tex);
+	cached_glBindTexture(GL_TEXTURE_2D, palette_tex);
+	//passing 'nullptr' to TexImage says "allocate memory but don't store anything there":
+	// (textures will be uploaded later)
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4, PPU::PaletteCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 	//make the texture have sharp pixels when magnified:
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	//when access past the edge, clamp to the edge:
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	cached_glBindTexture(GL_TEXTURE_2D, 0);
 
 
-	glGenTextures(1, &palette_tex);
-	glBindTexture(GL_TEXTURE_2D, palette_tex);
-	//passing 'nullptr' to TexImage says "allocate memory but don't store anything there":
-	// (textures will be uploaded later)
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 4, 8, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glGenTextures(1, &background_tex);
+	cached_glBindTexture(GL_TEXTURE_2D, background_tex);
+	//one 16-bit texel per background tile:
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, PPU::BackgroundWidth, PPU::BackgroundHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, nullptr);
 	//make the texture have sharp pixels when magnified:
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	//when access past the edge, clamp to the edge:
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	cached_glBindTexture(GL_TEXTURE_2D, 0);
+
+
+	glGenRenderbuffers(1, &offscreen_color);
+	glBindRenderbuffer(GL_RENDERBUFFER, offscreen_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, PPU::ScreenWidth, PPU::ScreenHeight);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	//(the data stream is created in the middle of the first draw, so whatever framebuffers the caller has bound are put back afterward)
+	GLuint old_draw_framebuffer = cached_framebuffer_binding(GL_DRAW_FRAMEBUFFER);
+	GLuint old_read_framebuffer = cached_framebuffer_binding(GL_READ_FRAMEBUFFER);
+	glGenFramebuffers(1, &offscreen_framebuffer);
+	cached_glBindFramebuffer(GL_FRAMEBUFFER, offscreen_framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreen_color);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		throw std::runtime_error("PPU466 offscreen framebuffer is incomplete.");
+	}
+	cached_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, old_draw_framebuffer);
+	cached_glBindFramebuffer(GL_READ_FRAMEBUFFER, old_read_framebuffer);
+
+
+	for (auto &set : timer_ring) {
+		glGenQueries(GLsizei(set.queries.size()), set.queries.data());
+	}
 
 
 	GL_ERRORS();
 }
 
-PPUDataStream::~PPUDataStream() {
-	if (vertex_buffer_for_tile_program != 0) {
-		glDeleteVertexArrays(1, &vertex_buffer_for_tile_program);
-		vertex_buffer_for_tile_program = 0;
+template< typename PPU >
+PPUDataStream< PPU >::~PPUDataStream() {
+	//deleted objects are unbound (and their names may be handed out again), so the GL state cache can't be trusted after this:
+	invalidate_GL_state();
+
+	for (auto &slot : vertex_ring) {
+		if (slot.vertex_buffer_for_tile_program != 0) {
+			glDeleteVertexArrays(1, &slot.vertex_buffer_for_tile_program);
+			slot.vertex_buffer_for_tile_program = 0;
+		}
+		if (slot.vertex_buffer != 0) {
+			glDeleteBuffers(1, &slot.vertex_buffer);
+			slot.vertex_buffer = 0;
+		}
+		if (slot.fence != 0) {
+			glDeleteSync(slot.fence);
+			slot.fence = 0;
+		}
 	}
-	if (vertex_buffer != 0) {
-		glDeleteBuffers(1, &vertex_buffer);
-		vertex_buffer = 0;
+	if (sprite_buffer_for_sprite_program != 0) {
+		glDeleteVertexArrays(1, &sprite_buffer_for_sprite_program);
+		sprite_buffer_for_sprite_program = 0;
+	}
+	if (sprite_buffer != 0) {
+		glDeleteBuffers(1, &sprite_buffer);
+		sprite_buffer = 0;
 	}
 	if (tile_tex != 0) {
 		glDeleteTextures(1, &tile_tex);
 		tile_tex = 0;
 	}
+	if (tile_bitplanes_tex != 0) {
+		glDeleteTextures(1, &tile_bitplanes_tex);
+		tile_bitplanes_tex = 0;
+	}
 	if (palette_tex != 0) {
 		glDeleteTextures(1, &palette_tex);
 		palette_tex = 0;
 	}
+	if (background_tex != 0) {
+		glDeleteTextures(1, &background_tex);
+		background_tex = 0;
+	}
+	if (offscreen_framebuffer != 0) {
+		glDeleteFramebuffers(1, &offscreen_framebuffer);
+		offscreen_framebuffer = 0;
+	}
+	if (offscreen_color != 0) {
+		glDeleteRenderbuffers(1, &offscreen_color);
+		offscreen_color = 0;
+	}
+	for (auto &set : timer_ring) {
+		if (set.queries[0] != 0) {
+			glDeleteQueries(GLsizei(set.queries.size()), set.queries.data());
+			set.queries.fill(0);
+		}
+	}
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//the batch stream's textures are allocated by PPU466::draw_batch, a group at a time, once it knows how many PPUs it is drawing:
+template< typename PPU >
+PPUBatchStream< PPU >::PPUBatchStream() {
+	{ //every group's tile layers need to fit in one array texture:
+		GLint max_layers = 0;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+		assert(uint32_t(max_layers) >= GroupSize * PPU::TileBanks && "GL_MAX_ARRAY_TEXTURE_LAYERS is at least 256 in OpenGL 3.3");
+	}
+
+	glGenVertexArrays(1, &vertex_buffer_for_tile_program);
+	cached_glBindVertexArray(vertex_buffer_for_tile_program);
+
+	glGenBuffers(1, &vertex_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	set_tile_program_attributes();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	cached_glBindVertexArray(0);
+
+	GL_ERRORS();
+}
+
+template< typename PPU >
+PPUBatchStream< PPU >::~PPUBatchStream() {
+	invalidate_GL_state(); //(see ~PPUDataStream)
+
+	if (vertex_buffer_for_tile_program != 0) {
+		glDeleteVertexArrays(1, &vertex_buffer_for_tile_program);
+		vertex_buffer_for_tile_program = 0;
+	}
+	if (vertex_buffer != 0) {
+		glDeleteBuffers(1, &vertex_buffer);
+		vertex_buffer = 0;
+	}
+	for (auto &group : groups) {
+		glDeleteTextures(1, &group.tile_tex);
+		glDeleteTextures(1, &group.palette_tex);
+	}
+	groups.clear();
 }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//compile the drawing functions of the configurations declared in PPU466.hpp:
+// (the configurations themselves -- constructors and all -- are instantiated in PPU466_cpu.cpp, which doesn't depend on GL)
+#define PPU466_INSTANTIATE_DRAWING(PPU) \
+	template void PPU::draw(glm::uvec2 const &) const; \
+	template void PPU::draw(glm::ivec2 const &, glm::uvec2 const &) const; \
+	template void PPU::draw_batch(std::vector< PPU const * > const &, glm::uvec2 const &, uint32_t); \
+	template PPU466Base::StreamStats const &PPU::stream_stats(); \
+	template PPU466Base::DrawTimings const &PPU::draw_timings();
+
+PPU466_INSTANTIATE_DRAWING(PPU466)
+PPU466_INSTANTIATE_DRAWING(PPU466Wide)
+PPU466_INSTANTIATE_DRAWING(PPU466Tiny)
@@ -2,41 +2,53 @@
 
 /*
  * PPU466 -- a very limited graphics system [loosely] based on the NES's PPU.
- * 
+ *
+ * The screen size, number of tile banks, number of palettes, and number of sprites are template parameters
+ *  of BasicPPU466, so every table, loop bound, and GPU buffer is sized at compile time for each configuration:
+ *    PPU466      -- the usual 256x240 PPU
+ *    PPU466Wide  -- a 320x240 widescreen PPU
+ *    PPU466Tiny  -- a 128x120 PPU with one tile bank, four palettes, and 16 sprites (e.g., for batch simulation)
  *
  */
 
 #include <glm/glm.hpp>
 #include <array>
+#include <vector>
+#include <type_traits>
 
-struct PPU466 {
-	PPU466();
-
-	//--------------------------------------------------------------
-	//Call these functions to draw with the PPU:
+//The number of sprites the (default) PPU draws can be set at compile time, e.g. -DPPU466_SPRITE_COUNT=256:
+#ifndef PPU466_SPRITE_COUNT
+#define PPU466_SPRITE_COUNT 64
+#endif
 
-	//when you wish the PPU to draw, tell it so:
-	// pass the size of the current framebuffer in pixels so it knows how to scale itself
-	void draw(glm::uvec2 const &drawable_size) const;
-
-	//for debugging, you can ask the PPU to draw its current tiles, palettes, etc:
-	// pass the size of the current framebuffer in pixels so it knows how to scale itself
-	//someday, maybe: void draw_DEBUG_overlay(glm::uvec2 drawable_size) const;
-
-	//--------------------------------------------------------------
-	//Set the values below to control the PPU's drawing:
-
-	//The PPU's screen is 256x240:
-	// the origin -- pixel (0,0) -- is in the lower left
-	enum : uint32_t {
-		ScreenWidth = 256,
-		ScreenHeight = 240
+//The parts of the PPU that are the same in every configuration:
+struct PPU466Base {
+	//statistics about how PPU466::draw streams data to the GPU:
+	// (shared by all PPUs of the same configuration, since they share GPU buffers)
+	struct StreamStats {
+		uint64_t uploads = 0; //vertex uploads performed
+		uint64_t stalls_avoided = 0; //uploads where the previous frame's vertex buffer was still in use by the GPU
+		uint64_t orphaned = 0; //uploads that found their own ring slot still in use, and orphaned it rather than waiting
+		uint64_t waited = 0; //uploads that found their own (persistently mapped, so un-orphanable) ring slot still in use, and waited for it
+		uint64_t uploads_skipped = 0; //draws of the same state as the previous draw, which re-drew its vertices without decoding, building, or uploading anything
+		uint64_t frames_reused = 0; //draws of the same state as the offscreen image, which just blitted it again (OutputMode::Offscreen)
 	};
 
-	//Background Color:
-	// The PPU clears the screen to the background color before other drawing takes place:
-	// the screen is cleared to this color before any other drawing takes place
-	glm::u8vec3 background_color = glm::u8vec3(0x00, 0x00, 0x00);
+	//how long the phases of the most recent PPU466::draw took, in milliseconds:
+	// (shared by all PPUs of the same configuration; accumulate or log these each frame as needed)
+	struct DrawTimings {
+		//CPU time spent in each phase:
+		double decode = 0.0; //hashing the state, then finding, classifying, and decoding changed tiles and palettes
+		double build = 0.0; //building the quads (0 for a re-drawn or re-used state)
+		double upload = 0.0; //issuing texture and vertex uploads
+		double draw = 0.0; //issuing draw calls (and the offscreen blit, if any)
+		//GPU time spent in each phase:
+		// (read back a few frames late without waiting, so these lag behind the CPU times)
+		double gpu_upload = 0.0;
+		double gpu_draw = 0.0;
+		uint64_t frames = 0; //number of draws timed on the CPU
+		uint64_t gpu_frames = 0; //number of draws whose GPU times have been read back
+	};
 
 	//Palette:
 	// The PPU uses 4-bit indexed color.
@@ -46,10 +58,6 @@ struct PPU466 {
 	//   color 0 to fully transparent
 	//   and color 1-3 to fully opaque.
 
-	//Palette Table:
-	// The PPU stores 8 palettes for use when drawing tiles:
-	std::array< Palette, 8 > palette_table;
-
 	//Tile:
 	// The PPU uses 8x8 4-bit indexed-color tiles:
 	// each tile is stored as two 8x8 "bit plane" images
@@ -67,30 +75,175 @@ struct PPU466 {
 	};
 	static_assert(sizeof(Tile) == 16, "Tile is packed");
 
+	//Sprite attribute bits (see BasicPPU466::Sprite):
+	enum : uint8_t {
+		SpriteFlipHorizontal = 0x08,
+		SpriteFlipVertical = 0x10,
+		SpriteRotate90 = 0x20,
+		SpriteBankSelect = 0x40
+	};
+
+	//--------------------------------------------------------------
+	//Drawing options:
+	// these change how PPU466::draw gets the image to the GPU, not what the image looks like.
+
+	//Background Mode:
+	// Tiles   - the background is streamed as one quad per background tile (as it was drawn originally)
+	// Tilemap - the background is uploaded as a BackgroundWidth x BackgroundHeight index texture
+	//           (only when it changes) and drawn as one screen-sized quad that looks up tiles per-fragment
+	enum class BackgroundMode : uint8_t {
+		Tiles,
+		Tilemap
+	};
+	BackgroundMode background_mode = BackgroundMode::Tiles;
+
+	//Sprite Mode:
+	// Tiles     - sprites are streamed as one quad (six vertices) per sprite (as they were drawn originally)
+	// Instanced - the sprite list is uploaded as-is as per-instance data and quads are built in the vertex shader
+	enum class SpriteMode : uint8_t {
+		Tiles,
+		Instanced
+	};
+	SpriteMode sprite_mode = SpriteMode::Tiles;
+
+	//Tile Mode:
+	// Decoded   - changed tiles are decoded to one byte per pixel on the CPU and uploaded as an index image (as they were originally)
+	// Bitplanes - changed tiles are uploaded as-is (16 bytes each) and their bitplanes are decoded per-fragment
+	//             (no CPU decoding and a quarter of the upload bandwidth, which helps when tiles are animated every frame)
+	enum class TileMode : uint8_t {
+		Decoded,
+		Bitplanes
+	};
+	TileMode tile_mode = TileMode::Decoded;
+
+	//Output Mode:
+	// Direct    - tiles are rasterized straight into the drawable at the scaled-up size (as they were drawn originally)
+	// Offscreen - tiles are rasterized into a native ScreenWidth x ScreenHeight framebuffer,
+	//             which is then scaled into the drawable with a single blit
+	//             (so fragment work no longer grows with the drawable size)
+	enum class OutputMode : uint8_t {
+		Direct,
+		Offscreen
+	};
+	OutputMode output_mode = OutputMode::Direct;
+};
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_ = 4, uint32_t PaletteCount_ = 8, uint32_t SpriteCount_ = PPU466_SPRITE_COUNT >
+struct BasicPPU466 : PPU466Base {
+	BasicPPU466();
+
+	//--------------------------------------------------------------
+	//Call these functions to draw with the PPU:
+
+	//when you wish the PPU to draw, tell it so:
+	// pass the size of the current framebuffer in pixels so it knows how to scale itself
+	void draw(glm::uvec2 const &drawable_size) const;
+
+	//...or, to draw into only part of the framebuffer (e.g., one half of a split screen), pass that part's lower left corner and size:
+	// the screen is scaled and centered within the viewport, and only the viewport is cleared to background_color
+	// (state is set through the GL state cache in GL.hpp; bindings are left as they are, the scissor test is left disabled,
+	//  and the viewport is left set to the one passed in -- so, for the overload above, covering the whole drawable)
+	void draw(glm::ivec2 const &viewport_lower_left, glm::uvec2 const &viewport_size) const;
+
+	//when you wish several PPUs (of the same configuration) to draw side by side -- e.g., for a spectator wall -- use:
+	// ppus[i] is drawn into cell (i % columns, i / columns) of a grid (filled left-to-right, top-to-bottom) that is scaled to fit the drawable
+	// all of the PPUs share one vertex upload and a few draw calls (three for each group of up to 256 / (PaletteCount + 1) PPUs -- 28 for PPU466)
+	// (the PPUs' drawing options are ignored: their backgrounds and sprites are always drawn as decoded tiles, directly to the drawable)
+	static void draw_batch(std::vector< BasicPPU466 const * > const &ppus, glm::uvec2 const &drawable_size, uint32_t columns);
+
+	//when you wish the PPU to draw without an OpenGL context (e.g., on a headless machine), use:
+	// the framebuffer is resized to ScreenWidth x ScreenHeight and filled with RGBA pixels
+	// stored in rows from bottom-to-top (the same layout as glReadPixels / LowerLeftOrigin)
+	//NOTE: this is defined in PPU466_cpu.cpp, which does not depend on GL
+	void render_cpu(std::vector< glm::u8vec4 > *framebuffer) const;
+
+	//a 64-bit hash of everything that affects what the PPU draws (tables, background, scroll, sprites, and drawing options):
+	//NOTE: like the constructor, this is defined in PPU466_cpu.cpp
+	// PPU466::draw uses this to notice when it is asked to draw the same state again (e.g., on menus or pause screens),
+	// and reuses the previous frame rather than rebuilding and re-uploading it.
+	// (the hash is fast, not cryptographic -- two different states are just very unlikely to share one)
+	uint64_t state_hash() const;
+
+	//see PPU466Base::StreamStats and PPU466Base::DrawTimings:
+	// (GPU resources for a configuration are created by its first draw -- or by these, so call them with a GL context current)
+	static StreamStats const &stream_stats();
+	static DrawTimings const &draw_timings();
+
+	//for debugging, you can ask the PPU to draw its current tiles, palettes, etc:
+	// pass the size of the current framebuffer in pixels so it knows how to scale itself
+	//someday, maybe: void draw_DEBUG_overlay(glm::uvec2 drawable_size) const;
+
+	//--------------------------------------------------------------
+	//Set the values below to control the PPU's drawing:
+
+	//The PPU's screen is ScreenWidth x ScreenHeight (256x240 for the default PPU466):
+	// the origin -- pixel (0,0) -- is in the lower left
+	enum : uint32_t {
+		ScreenWidth = ScreenWidth_,
+		ScreenHeight = ScreenHeight_
+	};
+	static_assert(ScreenWidth % 8 == 0 && ScreenHeight % 8 == 0, "The screen is a whole number of tiles.");
+
+	//Background Color:
+	// The PPU clears the screen to the background color before other drawing takes place:
+	// the screen is cleared to this color before any other drawing takes place
+	glm::u8vec3 background_color = glm::u8vec3(0x00, 0x00, 0x00);
+
+	//Palette Table:
+	// The PPU stores PaletteCount (8 for the default PPU466) palettes for use when drawing tiles:
+	enum : uint32_t {
+		PaletteCount = PaletteCount_
+	};
+	static_assert(PaletteCount == 1 || PaletteCount == 2 || PaletteCount == 4 || PaletteCount == 8, "Palette indices are (up to) three bits.");
+	std::array< Palette, PaletteCount > palette_table;
+
 	//Tile Table:
-	// The PPU has a 256-tile 'pattern memory' in which tiles are stored:
-	//  this is often thought of as a 16x16 grid of tiles.
-	std::array< Tile, 16 * 16 > tile_table;
+	// The PPU has TileBanks banks of 256-tile 'pattern memory' in which tiles are stored:
+	//  each bank is often thought of as a 16x16 grid of tiles.
+	//  tile i of bank b is tile_table[b * 256 + i]
+	enum : uint32_t {
+		TileBanks = TileBanks_
+	};
+	static_assert(TileBanks >= 1 && TileBanks <= 4, "The PPU has one to four tile banks.");
+	std::array< Tile, 16 * 16 * TileBanks > tile_table;
+
+	//Bank Select Tables:
+	// Background tiles and sprites only have room for an 8-bit tile index, so they choose their bank indirectly:
+	//  bits 11-13 of a background value pick an entry of background_banks,
+	//  bit 6 of a sprite's attributes picks an entry of sprite_banks,
+	//  and that entry is the tile bank (0 to TileBanks-1) the tile index refers to.
+	// Changing these tables switches banks without touching (or re-uploading) the tile table.
+	// (initially, entry i of each table is bank i % TileBanks)
+	std::array< uint8_t, 8 > background_banks;
+	std::array< uint8_t, 2 > sprite_banks;
 
 	//Background Layer:
-	// The PPU's background layer is made of 64x60 tiles (512 x 480 pixels):
+	// The PPU's background layer is made of BackgroundWidth x BackgroundHeight tiles -- twice the screen size in each direction:
+	//  (64x60 tiles, or 512 x 480 pixels, for the default PPU466)
 	enum : uint32_t {
-		BackgroundWidth = 64,
-		BackgroundHeight = 60
+		BackgroundWidth = ScreenWidth / 4,
+		BackgroundHeight = ScreenHeight / 4
+	};
+	// At most VisibleBackgroundWidth x VisibleBackgroundHeight of these tiles overlap the screen at once:
+	enum : uint32_t {
+		VisibleBackgroundWidth = ScreenWidth / 8 + 1,
+		VisibleBackgroundHeight = ScreenHeight / 8 + 1
 	};
 
 	// The background is stored as a row-major grid of 16-bit values:
 	//  the origin of the grid (tile (0,0)) is the bottom left of the grid
 	//  each value in the grid gives:
-	//    - bits 0-7: tile table index
-	//    - bits 8-10: palette table index
-	//    - bits 11-15: unused, should be 0
+	//    - bits 0-7: tile table index (within a bank)
+	//    - bits 8-10: palette table index (only the low bits are used when PaletteCount < 8)
+	//    - bits 11-13: bank select (index into background_banks)
+	//    - bits 14-15: unused, should be 0
 	//
 	//  bits:  F E D C B A 9 8 7 6 5 4 3 2 1 0
-	//        |---------|-----|---------------|
-	//            ^        ^        ^-- tile index
-	//            |        '----------- palette index
-	//            '-------------------- unused (set to zero)
+	//        |---|-----|-----|---------------|
+	//          ^    ^     ^        ^-- tile index
+	//          |    |     '----------- palette index
+	//          |    '----------------- bank select
+	//          '---------------------- unused (set to zero)
 	std::array< uint16_t, BackgroundWidth * BackgroundHeight > background;
 
 	//Background Position:
@@ -99,7 +252,7 @@ struct PPU466 {
 	glm::ivec2 background_position = glm::ivec2(0,0);
 	//
 	// screen pixels "outside the background" wrap around to the other side.
-	// thus, background_position values of (x,y) and of (x+n*512,y+m*480) for
+	// thus, background_position values of (x,y) and of (x+n*8*BackgroundWidth,y+m*8*BackgroundHeight) for
 	// any integers n,m will look the same
 
 	//Sprite:
@@ -108,36 +261,58 @@ struct PPU466 {
 	//  sprite positions (x,y) place the bottom-left of the sprite...
 	//      ... x pixels from the left of the screen
 	//      ... y pixels from the bottom of the screen
+	//  (positions are bytes unless the screen is too large for them to reach its right edge or past its top edge)
 	//
 	//  the sprite index is an index into the tile table
 	//
 	//  the sprite 'attributes' byte gives:
 	//   bits:  7 6 5 4 3 2 1 0
-	//         |-|-------|-----|
-	//          ^    ^      ^
-	//          |    |      '---- palette index (bits 0-2)
-	//          |    '----------- unused (set to zero)
+	//         |-|-|-|-|-|-----|
+	//          ^ ^ ^ ^ ^   ^
+	//          | | | | |   '---- palette index (bits 0-2, only the low bits are used when PaletteCount < 8)
+	//          | | | | '-------- flip horizontal bit (bit 3)
+	//          | | | '---------- flip vertical bit (bit 4)
+	//          | | '------------ rotate bit (bit 5)
+	//          | '-------------- bank select bit (bit 6 -- index into sprite_banks)
 	//          '---------------- priority bit (bit 7)
 	//
 	//  the 'priority bit' chooses whether to render the sprite
 	//   in front of (priority = 0) the background
 	//   or behind (priority = 1) the background
 	//
+	//  the 'rotate', 'flip horizontal', and 'flip vertical' bits transform the sprite's tile
+	//   as it is drawn: first rotating it by 90 degrees clockwise, then mirroring it
+	//   (so, e.g., a sprite with all three bits set is the tile rotated 90 degrees counterclockwise)
+	//   (see PPU466Base::SpriteFlipHorizontal and friends)
+	//
+	typedef typename std::conditional< (ScreenWidth > 256 || ScreenHeight > 255), uint16_t, uint8_t >::type SpriteCoordinate;
 	struct Sprite {
-		uint8_t x = 0; //x position. 0 is the left edge of the screen.
-		uint8_t y = 240; //y position. 0 is the bottom edge of the screen. >= 240 is off-screen
+		SpriteCoordinate x = 0; //x position. 0 is the left edge of the screen.
+		SpriteCoordinate y = SpriteCoordinate(ScreenHeight); //y position. 0 is the bottom edge of the screen. >= ScreenHeight is off-screen
 		uint8_t index = 0; //index into tile table
 		uint8_t attributes = 0; //tile attribute bits
 	};
-	static_assert(sizeof(Sprite) == 4, "Sprite is a 32-bit value.");
+	static_assert(sizeof(Sprite) == 2 * sizeof(SpriteCoordinate) + 2, "Sprite is packed.");
 	//
 	// The observant among you will notice that you can't draw a sprite moving off the left
 	//  or bottom edges of the screen. Yep! This is [similar to] a limitation of the NES PPU!
 
 
 	//Sprites:
-	// The PPU always draws exactly 64 sprites:
-	//  any sprites you don't want to use should be moved off the screen (y >= 240)
-	std::array< Sprite, 64 > sprites;
-
+	// The PPU always draws exactly SpriteCount sprites (64 for PPU466, unless PPU466_SPRITE_COUNT says otherwise):
+	//  any sprites you don't want to use should be moved off the screen (y >= ScreenHeight)
+	//  (off-screen sprites are skipped before any drawing work is done for them, so unused sprites are cheap)
+	enum : uint32_t {
+		SpriteCount = SpriteCount_
+	};
+	std::array< Sprite, SpriteCount > sprites;
 };
+
+//The configurations below are compiled once, in PPU466_cpu.cpp (with their drawing functions compiled in PPU466.cpp):
+typedef BasicPPU466< 256, 240 > PPU466;
+typedef BasicPPU466< 320, 240 > PPU466Wide;
+typedef BasicPPU466< 128, 120, 1, 4, 16 > PPU466Tiny;
+
+extern template struct BasicPPU466< 256, 240 >;
+extern template struct BasicPPU466< 320, 240 >;
+extern template struct BasicPPU466< 128, 120, 1, 4, 16 >;
@@ -0,0 +1,167 @@
+#include "PPU466.hpp"
+#include "tile_kernels.hpp"
+
+//The parts of the PPU that don't touch OpenGL -- construction, state_hash(), and the CPU rasterizer -- live here,
+// so headless tools (tests, batch simulation, CI) can link just this file and tile_kernels.cpp, without GL or SDL.
+//The CPU rasterizer produces the same image as PPU466::draw.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace {
+	//same blending as glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA):
+	inline void blend(glm::u8vec4 &dst, glm::u8vec4 const &src) {
+		if (src.a == 0x00) return;
+		if (src.a == 0xff) {
+			dst = glm::u8vec4(src.r, src.g, src.b, 0xff);
+			return;
+		}
+		uint32_t a = src.a;
+		dst.r = uint8_t((src.r * a + dst.r * (0xff - a) + 0x7f) / 0xff);
+		dst.g = uint8_t((src.g * a + dst.g * (0xff - a) + 0x7f) / 0xff);
+		dst.b = uint8_t((src.b * a + dst.b * (0xff - a) + 0x7f) / 0xff);
+	}
+}
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::BasicPPU466() {
+	for (auto &palette : palette_table) {
+		palette[0] = glm::u8vec4(0x00, 0x00, 0x00, 0x00);
+		palette[1] = glm::u8vec4(0x44, 0x44, 0x44, 0xff);
+		palette[2] = glm::u8vec4(0x99, 0x99, 0x99, 0xff);
+		palette[3] = glm::u8vec4(0xff, 0xff, 0xff, 0xff);
+	}
+
+	for (auto &tile : tile_table) {
+		tile.bit0 = { 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0 };
+		tile.bit1 = { 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff };
+	}
+
+	for (uint32_t i = 0; i < background_banks.size(); ++i) {
+		background_banks[i] = uint8_t(i % TileBanks);
+	}
+	for (uint32_t i = 0; i < sprite_banks.size(); ++i) {
+		sprite_banks[i] = uint8_t(i % TileBanks);
+	}
+
+	for (uint32_t i = 0; i < background.size(); ++i) {
+		background[i] = int16_t(
+			  (i % PaletteCount) << 8 //cycle through all palettes
+			| (i % palette_table.size()) //cycle through all tiles
+		);
+	}
+}
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+uint64_t BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::state_hash() const {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+
+	//helper to mix a block of memory into the hash, a 64-bit word at a time:
+	// (the hashed members are all tightly packed, so no padding bytes get mixed in)
+	auto add = [&hash](void const *data, size_t size) {
+		uint8_t const *bytes = reinterpret_cast< uint8_t const * >(data);
+		auto mix = [&hash](uint64_t word) {
+			hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+			hash ^= hash >> 29;
+		};
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, bytes + i, 8);
+			mix(word);
+		}
+		if (i < size) { //leftover bytes:
+			uint64_t word = 0;
+			std::memcpy(&word, bytes + i, size - i);
+			mix(word);
+		}
+	};
+
+	add(&background_color, sizeof(background_color));
+	add(palette_table.data(), sizeof(palette_table));
+	add(tile_table.data(), sizeof(tile_table));
+	add(background_banks.data(), sizeof(background_banks));
+	add(sprite_banks.data(), sizeof(sprite_banks));
+	add(background.data(), sizeof(background));
+	add(&background_position, sizeof(background_position));
+	add(sprites.data(), sizeof(sprites));
+
+	uint8_t modes[4] = { uint8_t(background_mode), uint8_t(sprite_mode), uint8_t(tile_mode), uint8_t(output_mode) };
+	add(modes, sizeof(modes));
+
+	return hash;
+}
+
+template< uint32_t ScreenWidth_, uint32_t ScreenHeight_, uint32_t TileBanks_, uint32_t PaletteCount_, uint32_t SpriteCount_ >
+void BasicPPU466< ScreenWidth_, ScreenHeight_, TileBanks_, PaletteCount_, SpriteCount_ >::render_cpu(std::vector< glm::u8vec4 > *framebuffer_) const {
+	assert(framebuffer_);
+	auto &framebuffer = *framebuffer_;
+	framebuffer.resize(ScreenWidth * ScreenHeight);
+
+	constexpr int32_t BackgroundWidthPixels = int32_t(BackgroundWidth) * 8;
+	constexpr int32_t BackgroundHeightPixels = int32_t(BackgroundHeight) * 8;
+
+	//helper to composite one (decoded) row of a tile onto a scanline:
+	auto composite_row = [](glm::u8vec4 *line, int32_t left, uint64_t indices, Palette const &palette) {
+		if (indices == 0 && palette[0].a == 0x00) return; //fully transparent row
+		int32_t begin = std::max(0, -left);
+		int32_t end = std::min(8, int32_t(ScreenWidth) - left);
+		for (int32_t i = begin; i < end; ++i) {
+			blend(line[left + i], palette[(indices >> (8 * i)) & 0x3]);
+		}
+	};
+
+	//helper to composite the part of the sprite list that overlaps a scanline:
+	auto composite_sprites = [this,&composite_row](glm::u8vec4 *line, int32_t y, uint8_t priority) {
+		for (auto const &sprite : sprites) {
+			if ((sprite.attributes & 0x80) != priority) continue;
+			int32_t row = y - int32_t(sprite.y);
+			if (row < 0 || row >= 8) continue;
+			//rotate, then flip the tile as the sprite's attributes ask:
+			Tile tile = tile_table[sprite_banks[(sprite.attributes & SpriteBankSelect) ? 1 : 0] * 256 + sprite.index];
+			if (sprite.attributes & SpriteRotate90) tile = tile_rotate90(tile);
+			if (sprite.attributes & SpriteFlipHorizontal) tile = tile_flip_horizontal(tile);
+			if (sprite.attributes & SpriteFlipVertical) tile = tile_flip_vertical(tile);
+			composite_row(line, sprite.x,
+				tile_row_indices(tile, row),
+				palette_table[sprite.attributes & (PaletteCount - 1)] //just the palette index part
+			);
+		}
+	};
+
+	//the background pixel that lands at the left edge of the screen:
+	// (see PPU466::draw -- background pixel (u,v) appears at screen pixel (u,v) + background_position, wrapped)
+	const int32_t left_u = ((-background_position.x % BackgroundWidthPixels) + BackgroundWidthPixels) % BackgroundWidthPixels;
+
+	for (int32_t y = 0; y < int32_t(ScreenHeight); ++y) {
+		glm::u8vec4 *line = &framebuffer[y * ScreenWidth];
+
+		//background gets background color:
+		std::fill(line, line + ScreenWidth, glm::u8vec4(background_color, 0xff));
+
+		composite_sprites(line, y, 0x80); //sprites with priority == 1 ('behind' sprites)
+
+		{ //background, wrapped around at its edges:
+			int32_t v = (((y - background_position.y) % BackgroundHeightPixels) + BackgroundHeightPixels) % BackgroundHeightPixels;
+			uint16_t const *row = &background[(v / 8) * BackgroundWidth];
+			int32_t col = left_u / 8;
+			for (int32_t x = -(left_u % 8); x < int32_t(ScreenWidth); x += 8) {
+				uint16_t info = row[col];
+				composite_row(line, x,
+					tile_row_indices(tile_table[background_banks[(info >> 11) & 0x07] * 256 + (info & 0xff)], v % 8), //extract bank select + tile index bits
+					palette_table[(info >> 8) & (PaletteCount - 1)] //extract palette index bits
+				);
+				col = (col + 1) % int32_t(BackgroundWidth);
+			}
+		}
+
+		composite_sprites(line, y, 0x00); //sprites with priority == 0 ('in front' sprites)
+	}
+}
+
+//compile the configurations declared in PPU466.hpp:
+// (this instantiates the members defined above; PPU466.cpp instantiates the drawing functions)
+template struct BasicPPU466< 256, 240 >;
+template struct BasicPPU466< 320, 240 >;
+template struct BasicPPU466< 128, 120, 1, 4, 16 >;
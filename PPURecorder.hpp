@@ -0,0 +1,233 @@
+#pragma once
+
+#include "read_write_chunk.hpp"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Record the state of a PPU466 (or PPU466Wide, PPU466Tiny, ...) every frame, compactly enough to keep whole play sessions around:
+ *
+ *   std::ofstream file("session.ppu", std::ios::binary);
+ *   PPURecorder< PPU466 > recorder(&file);
+ *   ... each frame: recorder.record(ppu);
+ *
+ * ...and play it back (through PPU466::draw or PPU466::render_cpu):
+ *
+ *   std::ifstream file("session.ppu", std::ios::binary);
+ *   PPUPlayer< PPU466 > player(&file);
+ *   while (player.next(&ppu)) { ppu.draw(drawable_size); ... }
+ *
+ * A recording is a sequence of read_write_chunk.hpp chunks:
+ *   'ppuh' - header (uint32_t): version, state size in bytes, and the PPU's ScreenWidth, ScreenHeight, TileBanks, PaletteCount, SpriteCount
+ *   'ppuf' - one per frame (uint8_t): the bytes of the recorded state that changed since the previous frame
+ *            (the state before the first frame is all zeros, so the first frame holds everything)
+ *
+ * The recorded state is everything that affects what the PPU draws:
+ *   background color, palettes, tiles, bank select tables, background, background position, and sprites
+ * (drawing options -- background_mode and friends -- don't change the image, so they aren't recorded)
+ *
+ * A frame is encoded as runs of changed bytes, each written as:
+ *   [unchanged bytes to skip (varint)] [changed bytes that follow (varint)] [the changed bytes]
+ * where a varint is 7 bits per byte, low bits first, high bit set on all but the last byte.
+ * A typical frame -- a few sprites moved, maybe a scroll -- comes to tens or hundreds of bytes.
+ */
+
+//the part of a PPU's state that recordings store, flattened to bytes:
+template< typename PPU >
+struct PPURecordedState {
+	//call f on each recorded member of ppu (a PPU or PPU const), in recording order:
+	template< typename P, typename F >
+	static void for_each_member(P &ppu, F &&f) {
+		f(ppu.background_color);
+		f(ppu.palette_table);
+		f(ppu.tile_table);
+		f(ppu.background_banks);
+		f(ppu.sprite_banks);
+		f(ppu.background);
+		f(ppu.background_position);
+		f(ppu.sprites);
+	}
+
+	static constexpr size_t Size =
+		  sizeof(PPU::background_color)
+		+ sizeof(PPU::palette_table)
+		+ sizeof(PPU::tile_table)
+		+ sizeof(PPU::background_banks)
+		+ sizeof(PPU::sprite_banks)
+		+ sizeof(PPU::background)
+		+ sizeof(PPU::background_position)
+		+ sizeof(PPU::sprites);
+
+	static void flatten(PPU const &ppu, std::vector< uint8_t > *bytes_) {
+		assert(bytes_);
+		auto &bytes = *bytes_;
+		bytes.resize(Size);
+		uint8_t *at = bytes.data();
+		for_each_member(ppu, [&at](auto const &member) {
+			std::memcpy(at, &member, sizeof(member));
+			at += sizeof(member);
+		});
+		assert(at == bytes.data() + Size);
+	}
+
+	static void unflatten(std::vector< uint8_t > const &bytes, PPU *ppu_) {
+		assert(ppu_);
+		assert(bytes.size() == Size);
+		uint8_t const *at = bytes.data();
+		for_each_member(*ppu_, [&at](auto &member) {
+			//(void * cast because some members are glm types, which memcpy warns about)
+			std::memcpy(static_cast< void * >(&member), at, sizeof(member));
+			at += sizeof(member);
+		});
+		assert(at == bytes.data() + Size);
+	}
+};
+
+namespace PPURecording {
+	enum : uint32_t { Version = 1 };
+
+	//header chunk contents for a given PPU configuration:
+	template< typename PPU >
+	std::vector< uint32_t > header() {
+		return std::vector< uint32_t >{
+			Version,
+			uint32_t(PPURecordedState< PPU >::Size),
+			PPU::ScreenWidth, PPU::ScreenHeight, PPU::TileBanks, PPU::PaletteCount, PPU::SpriteCount
+		};
+	}
+
+	inline void write_varint(uint32_t value, std::vector< uint8_t > *to) {
+		while (value >= 0x80) {
+			to->emplace_back(uint8_t(value | 0x80));
+			value >>= 7;
+		}
+		to->emplace_back(uint8_t(value));
+	}
+
+	//(throws if the varint runs past 'end')
+	inline uint32_t read_varint(uint8_t const *&at, uint8_t const *end) {
+		uint32_t value = 0;
+		for (uint32_t shift = 0; shift < 32; shift += 7) {
+			if (at == end) throw std::runtime_error("PPU recording frame ends in the middle of a number.");
+			uint8_t byte = *(at++);
+			value |= uint32_t(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) return value;
+		}
+		throw std::runtime_error("PPU recording frame has an over-long number.");
+	}
+}
+
+template< typename PPU >
+struct PPURecorder {
+	//writes the header chunk to 'to' right away; 'to' must outlive the recorder:
+	PPURecorder(std::ostream *to_) : to(to_) {
+		assert(to);
+		previous.assign(PPURecordedState< PPU >::Size, 0);
+		write_chunk("ppuh", PPURecording::header< PPU >(), to);
+	}
+
+	//append the current state of ppu as the next frame:
+	void record(PPU const &ppu) {
+		PPURecordedState< PPU >::flatten(ppu, &current);
+
+		//runs of changed bytes are merged when only a few unchanged bytes separate them,
+		// since starting a new run costs (at least) two bytes:
+		constexpr size_t MergeGap = 4;
+
+		delta.clear();
+		size_t run_end = 0; //end of the previous run
+		size_t i = 0;
+		while (i < current.size()) {
+			if (current[i] == previous[i]) {
+				++i;
+				continue;
+			}
+			//a run starts at i; extend it until MergeGap unchanged bytes in a row (or the end):
+			size_t begin = i;
+			size_t end = i + 1;
+			for (size_t j = end; j < current.size() && j < end + MergeGap; ++j) {
+				if (current[j] != previous[j]) end = j + 1;
+			}
+			PPURecording::write_varint(uint32_t(begin - run_end), &delta);
+			PPURecording::write_varint(uint32_t(end - begin), &delta);
+			delta.insert(delta.end(), current.begin() + begin, current.begin() + end);
+			run_end = i = end;
+		}
+
+		write_chunk("ppuf", delta, to);
+		frames += 1;
+		bytes_written += 8 + delta.size(); //(chunk header + frame)
+
+		std::swap(previous, current);
+	}
+
+	std::ostream *to;
+
+	//for curiosity (or budgeting): frames recorded and bytes written for them so far
+	uint64_t frames = 0;
+	uint64_t bytes_written = 0;
+
+	//scratch storage, kept around between frames:
+	std::vector< uint8_t > previous; //state as of the last recorded frame
+	std::vector< uint8_t > current;
+	std::vector< uint8_t > delta;
+};
+
+template< typename PPU >
+struct PPUPlayer {
+	//reads (and checks) the header chunk from 'from' right away; 'from' must outlive the player:
+	// (throws if the recording was made with a different PPU configuration)
+	PPUPlayer(std::istream *from_) : from(from_) {
+		assert(from);
+		std::vector< uint32_t > header;
+		read_chunk(*from, "ppuh", &header);
+		if (header.empty() || header[0] != PPURecording::Version) {
+			throw std::runtime_error("PPU recording has an unknown version.");
+		}
+		if (header != PPURecording::header< PPU >()) {
+			throw std::runtime_error("PPU recording was made with a different PPU configuration.");
+		}
+		state.assign(PPURecordedState< PPU >::Size, 0);
+	}
+
+	//read the next frame into ppu (leaving its drawing options alone); returns false at the end of the recording:
+	// (throws if the recording is damaged)
+	bool next(PPU *ppu) {
+		assert(ppu);
+		if (from->peek() == std::istream::traits_type::eof()) return false;
+
+		read_chunk(*from, "ppuf", &delta);
+		uint8_t const *at = delta.data();
+		uint8_t const *end = at + delta.size();
+		size_t offset = 0;
+		while (at != end) {
+			offset += PPURecording::read_varint(at, end);
+			uint32_t length = PPURecording::read_varint(at, end);
+			if (offset + length > state.size() || length > size_t(end - at)) {
+				throw std::runtime_error("PPU recording frame writes outside of the state.");
+			}
+			std::memcpy(state.data() + offset, at, length);
+			at += length;
+			offset += length;
+		}
+		frames += 1;
+
+		PPURecordedState< PPU >::unflatten(state, ppu);
+		return true;
+	}
+
+	std::istream *from;
+
+	//frames played so far:
+	uint64_t frames = 0;
+
+	//state as of the last frame played, and scratch storage for reading frames:
+	std::vector< uint8_t > state;
+	std::vector< uint8_t > delta;
+};
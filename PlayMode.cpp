@@ -1,6 +1,7 @@
 #include "PlayMode.hpp"
 
 #include "Load.hpp"
+#include "tile_kernels.hpp"
 
 //for the GL_ERRORS() macro:
 #include "data_path.hpp"
@@ -12,6 +13,9 @@
 #include <bits/stdint-uintn.h>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <random>
 #include <string>
 #include <map>
@@ -20,8 +24,15 @@
 
 #define ENEMY_SPRITE_OFFSET 7
 #define BULLET_SPRITE_OFFSET 22
+static_assert(PPU466::SpriteCount > BULLET_SPRITE_OFFSET, "PlayMode needs sprite slots 0-21 for the player, basement, walls, and enemies, plus at least one for bullets (check PPU466_SPRITE_COUNT)");
 #define NULL_BACKGROUND_VALUE 0b0000011111111111
 
+// sprite attribute bits that turn a sprite drawn facing up to face right, down, or left:
+#define FACING_UP 0
+#define FACING_RIGHT (PPU466::SpriteRotate90)
+#define FACING_DOWN (PPU466::SpriteFlipHorizontal | PPU466::SpriteFlipVertical)
+#define FACING_LEFT (PPU466::SpriteRotate90 | PPU466::SpriteFlipHorizontal | PPU466::SpriteFlipVertical)
+
 std::array< PPU466::Palette, 8 > palette_table;
 std::array< PPU466::Tile, 16 * 16 > tile_table;
 
@@ -99,23 +110,15 @@ Load<void> sprite_loading(LoadTagDefault, []() -> void {
 							}
 						}
 						// convert & strore the bits into tile_table
-						tile_table[sprite_index*4].bit0[row] = std::stoi(bit0[row], nullptr, 2);
-						tile_table[sprite_index*4].bit1[row] = std::stoi(bit1[row], nullptr, 2);
+						tile_table[sprite_index].bit0[row] = std::stoi(bit0[row], nullptr, 2);
+						tile_table[sprite_index].bit1[row] = std::stoi(bit1[row], nullptr, 2);
 					}
 					line_counter++;
 				}
 
 				sprite_file.close();
 
-				// rorate the tiles (up->right->down->left)
-				for (size_t ind = sprite_index*4+1; ind < (sprite_index+1)*4; ++ind) {
-					for (int i = 0; i < 8; ++i) {
-						for (int j = 0; j < 8; ++j) {
-							tile_table[ind].bit0[i] += (tile_table[ind-1].bit0[j] & (1 << (7-i))) >> (7-i) << j;
-							tile_table[ind].bit1[i] += (tile_table[ind-1].bit1[j] & (1 << (7-i))) >> (7-i) << j;
-						}
-					}
-				}
+				// (the sprite faces up; the other directions are drawn with the FACING_* attribute bits)
 
 				// build an index to map the name of sprites to the index of tile & palette
 				name_to_index.insert( std::pair<std::string, size_t>(sprite_name, sprite_index));
@@ -168,7 +171,7 @@ Load<void> levels(LoadTagDefault, []() -> void {
 });
 
 void PlayMode::initialize_level(int level) {
-	ppu.tile_table = tile_table;
+	std::copy(tile_table.begin(), tile_table.end(), ppu.tile_table.begin()); //(all sprites live in tile bank 0)
 	ppu.palette_table = palette_table;
 
 	int y_offset = 0;
@@ -176,13 +179,13 @@ void PlayMode::initialize_level(int level) {
 
 	// load level 0
 	// 1. set player to sprites[0]
-	ppu.sprites[level].index = name_to_index["player"] * 4;
+	ppu.sprites[level].index = name_to_index["player"];
 	ppu.sprites[level].attributes = name_to_index["player"];
 	player.pos.x = level_table[level].player_x * tile_offset;
 	player.pos.y = level_table[level].player_y * tile_offset + y_offset;
 
 	// 2. set basement to sprites[1]
-	ppu.sprites[1].index = name_to_index["basement"] * 4;
+	ppu.sprites[1].index = name_to_index["basement"];
 	ppu.sprites[1].attributes = name_to_index["basement"];
 	ppu.sprites[1].x = level_table[level].basement_x * tile_offset;
 	ppu.sprites[1].y = level_table[level].basement_y * tile_offset + y_offset;
@@ -191,7 +194,7 @@ void PlayMode::initialize_level(int level) {
 	size_t index = 2;
 	for (std::vector<std::pair<int, int> >::iterator it = level_table[level].walls.begin(); 
 		 it != level_table[level].walls.end(); ++it) {
-			ppu.sprites[index].index = name_to_index["wall"] * 4;
+			ppu.sprites[index].index = name_to_index["wall"];
 			ppu.sprites[index].attributes = name_to_index["wall"];
 			ppu.sprites[index].x = it->first * tile_offset;
 			ppu.sprites[index].y = it->second * tile_offset + y_offset;
@@ -202,7 +205,7 @@ void PlayMode::initialize_level(int level) {
 
 	// 4. enemies [7-21]
 	for (index = ENEMY_SPRITE_OFFSET; index < 22; ++index) {
-		ppu.sprites[index].index = name_to_index["enemy"] * 4;
+		ppu.sprites[index].index = name_to_index["enemy"];
 		ppu.sprites[index].attributes = name_to_index["enemy"];
 	}
 	for (std::vector<std::pair<int, int> >::iterator it = level_table[level].enemies.begin(); 
@@ -224,8 +227,8 @@ void PlayMode::initialize_level(int level) {
 	}
 
 
-	// 5. bullets [22-63] -> initially all of them are out of screen
-	for (index = BULLET_SPRITE_OFFSET; index < 64; ++index) {
+	// 5. bullets [22-(sprite count - 1)] -> initially all of them are out of screen
+	for (index = BULLET_SPRITE_OFFSET; index < ppu.sprites.size(); ++index) {
 		ppu.sprites[index].attributes = name_to_index["bullet"];
 		Bullet bullet;
 		bullet.pos = glm::vec2(255, 255);
@@ -237,12 +240,16 @@ void PlayMode::initialize_level(int level) {
 	for (size_t i = 0; i < PPU466::BackgroundWidth * PPU466::BackgroundHeight; ++i) {
 		ppu.background[i] = NULL_BACKGROUND_VALUE;
 	}
-	uint16_t background_value = (name_to_index["wall"] << 8) + name_to_index["wall"] * 4;
+	rebuild_collision_map();
+	uint16_t background_value = (name_to_index["wall"] << 8) + name_to_index["wall"];
 	for (size_t i = 0; i < level_table[level].background.size(); ++i) {
 		int row = level_table[level].background[i].first;
 		int col = level_table[level].background[i].second;
-		ppu.background[row * PPU466::BackgroundWidth + col] = background_value;
+		set_background(row * PPU466::BackgroundWidth + col, background_value);
 	}
+
+	// 7. file the sprites that collisions are checked against (everything but bullets) into the grid
+	sprite_grid.reset(ppu.sprites, BULLET_SPRITE_OFFSET);
 }
 
 PlayMode::PlayMode() {
@@ -298,33 +305,143 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 	return false;
 }
 
+//------ sprite grid ------
+
+static_assert(PlayMode::SpriteGrid::Width * PlayMode::SpriteGrid::Height < PlayMode::SpriteGrid::None, "cell indices fit in uint16_t");
+
+void PlayMode::SpriteGrid::reset(decltype(PPU466::sprites) const &sprites, size_t count) {
+	assert(count <= sprites.size() && count < None);
+	cell_first.fill(None);
+	cell_of.assign(count, None);
+	next.assign(count, None);
+	prev.assign(count, None);
+	for (size_t i = 0; i < count; ++i) {
+		place(i, sprites[i].x, sprites[i].y);
+	}
+}
+
+void PlayMode::SpriteGrid::place(size_t index, PPU466::SpriteCoordinate x, PPU466::SpriteCoordinate y) {
+	assert(index < cell_of.size());
+	uint16_t cell = uint16_t((y / CellSize) * Width + (x / CellSize));
+	if (cell_of[index] == cell) return; //(most moves stay within a cell)
+
+	//unlink from the old cell:
+	if (cell_of[index] != None) {
+		if (prev[index] != None) next[prev[index]] = next[index];
+		else cell_first[cell_of[index]] = next[index];
+		if (next[index] != None) prev[next[index]] = prev[index];
+	}
+
+	//link at the front of the new cell:
+	cell_of[index] = cell;
+	prev[index] = None;
+	next[index] = cell_first[cell];
+	if (next[index] != None) prev[next[index]] = uint16_t(index);
+	cell_first[cell] = uint16_t(index);
+}
+
+template< typename F >
+void PlayMode::SpriteGrid::for_each_near(glm::vec2 pos, int width, F &&f) const {
+	//corners within 'width' of pos are in the cells covering [pos - width, pos + width]:
+	auto cell_range = [](float min, float max, int32_t &first, int32_t &last) {
+		first = std::max(int32_t(std::floor(min / CellSize)), 0);
+		last = std::min(int32_t(std::floor(max / CellSize)), int32_t(Width) - 1);
+	};
+	int32_t x0, x1, y0, y1;
+	cell_range(pos.x - width, pos.x + width, x0, x1);
+	cell_range(pos.y - width, pos.y + width, y0, y1);
+	for (int32_t cy = y0; cy <= y1; ++cy) {
+		for (int32_t cx = x0; cx <= x1; ++cx) {
+			for (uint16_t i = cell_first[cy * Width + cx]; i != None; i = next[i]) {
+				f(size_t(i));
+			}
+		}
+	}
+}
+
+void PlayMode::place_sprite(size_t index, PPU466::SpriteCoordinate x, PPU466::SpriteCoordinate y) {
+	ppu.sprites[index].x = x;
+	ppu.sprites[index].y = y;
+	if (index < sprite_grid.cell_of.size()) {
+		sprite_grid.place(index, x, y);
+	}
+}
+
+//------ background collision map ------
+
+void PlayMode::set_background(size_t index, uint16_t value) {
+	assert(index < ppu.background.size());
+	ppu.background[index] = value;
+
+	uint32_t row = uint32_t(index / PPU466::BackgroundWidth);
+	uint64_t bit = uint64_t(1) << (index % PPU466::BackgroundWidth);
+	if (value != NULL_BACKGROUND_VALUE) {
+		uint32_t bank = ppu.background_banks[(value >> 11) & 0x7];
+		solid_rows[row] |= bit;
+		solid_masks[index] = tile_opaque_mask(ppu.tile_table[bank * 256 + (value & 0xff)]);
+	} else {
+		solid_rows[row] &= ~bit;
+		solid_masks[index] = 0;
+	}
+}
+
+void PlayMode::rebuild_collision_map() {
+	solid_rows.fill(0);
+	for (size_t i = 0; i < ppu.background.size(); ++i) {
+		set_background(i, ppu.background[i]);
+	}
+}
+
 // decide if the given sprite collides with something else
-int PlayMode::check_collision(glm::vec2 sprite, size_t sprite_index, std::array<PPU466::Sprite, 64> *sprites, int width) {
-	// check collision with other sprites
-	for (size_t i = 0; i < BULLET_SPRITE_OFFSET; i++ ) {
-		if (i != sprite_index &&
+int PlayMode::check_collision(glm::vec2 sprite, size_t sprite_index, decltype(PPU466::sprites) *sprites, int width) {
+	// check collision with other sprites (only the ones near by, according to sprite_grid)
+	assert(sprites == &ppu.sprites); //(sprite_grid tracks ppu.sprites)
+	size_t hit = BULLET_SPRITE_OFFSET;
+	sprite_grid.for_each_near(sprite, width, [&](size_t i) {
+		if (i < hit && i != sprite_index &&
 			sprite.x < (*sprites)[i].x + (width) && 
 			((*sprites)[i].x) < (sprite.x + (width)) && 
 			sprite.y < (*sprites)[i].y + (width) && 
 			(*sprites)[i].y < (sprite.y + (width))) {
 				if (sprite.x != (*sprites)[i].x && sprite.y != (*sprites)[i].y) // not the same sprite
-					return i;
+					hit = i; // (lowest index wins, as when scanning every sprite in order)
 			}
+	});
+	if (hit != BULLET_SPRITE_OFFSET) {
+		return hit;
 	}
 
-	// check collision with background
+	// check collision with background: the sprite covers (at most) tiles col..col+1 of rows row..row+1
 	int col = sprite.x / 8;
 	int row = sprite.y / 8;
+	uint64_t cols = 0; // bits of the covered columns that are inside the background
+	for (int j = col; j <= col + 1; ++j) {
+		if (j >= 0 && j < int(PPU466::BackgroundWidth)) cols |= uint64_t(1) << j;
+	}
 	for (int i = row; i <= row + 1; ++i) {
-		for (int j = col; j <= col + 1; ++j) {
-			if (i < 0 || j < 0) {
-				continue;
-			}
-			int index = i * PPU466::BackgroundWidth + j;
-			if (ppu.background[index] != NULL_BACKGROUND_VALUE) {
-				return -index;
+		if (i < 0 || i >= int(PPU466::BackgroundHeight)) {
+			continue;
+		}
+		uint64_t hits = solid_rows[i] & cols;
+		if (hits && pixel_accurate_walls) {
+			// keep only the tiles where the sprite's box [x,x+width)x[y,y+width) overlaps opaque pixels:
+			int px = int(std::floor(sprite.x));
+			int py = int(std::floor(sprite.y));
+			int v0 = std::max(py - i * 8, 0);
+			int v1 = std::min(py + width - i * 8, 8);
+			uint64_t rows_mask = (v0 < v1 ? (~uint64_t(0) >> (64 - 8 * (v1 - v0))) << (8 * v0) : 0);
+			for (int j = col; j <= col + 1; ++j) {
+				if (!(j >= 0 && ((hits >> j) & 1))) continue;
+				int u0 = std::max(px - j * 8, 0);
+				int u1 = std::min(px + width - j * 8, 8);
+				uint64_t box = (u0 < u1 ? ((uint64_t(1) << (u1 - u0)) - 1) << u0 : 0) * 0x0101010101010101ULL & rows_mask;
+				if (!(box & solid_masks[i * PPU466::BackgroundWidth + j])) hits &= ~(uint64_t(1) << j);
 			}
 		}
+		if (hits) {
+			int j = (col >= 0 && ((hits >> col) & 1)) ? col : col + 1; // (leftmost covered tile first)
+			return -(i * int(PPU466::BackgroundWidth) + j);
+		}
 	}
 	// no collision
 	return sprite_index;
@@ -332,7 +449,7 @@ int PlayMode::check_collision(glm::vec2 sprite, size_t sprite_index, std::array<
 
 // return game_over
 bool PlayMode::hit_by_bullet(int collision_index, Tank &player, 
-				   std::array<PPU466::Sprite, 64> &sprites, 
+				   decltype(PPU466::sprites) &sprites, 
 				   std::vector<Tank>&enemies) {
 	if (collision_index == 0) { // player -> reset to 0, 0
 		//player.pos.x = 0;
@@ -344,8 +461,7 @@ bool PlayMode::hit_by_bullet(int collision_index, Tank &player,
 	}
 	else { // enemies or wall, remove from screen
 		if (collision_index < ENEMY_SPRITE_OFFSET) { // wall
-			sprites[collision_index].x = 255;
-			sprites[collision_index].y = 255;
+			place_sprite(collision_index, 255, 255);
 		} else { // enemies
 			enemies[collision_index-ENEMY_SPRITE_OFFSET].pos.x = 255;
 			enemies[collision_index-ENEMY_SPRITE_OFFSET].pos.y = 255;
@@ -420,15 +536,16 @@ void PlayMode::emit_bullet(Tank &tank) {
 	// 2. emit the bullet
 	bullets[index].direction.x = tank.direction.x;
 	bullets[index].direction.y = tank.direction.y;
+	ppu.sprites[BULLET_SPRITE_OFFSET + index].index = name_to_index["bullet"];
 	if (tank.direction.x == 0) {
 		if (tank.direction.y == 1) // up
-			ppu.sprites[BULLET_SPRITE_OFFSET + index].index = name_to_index["bullet"] * 4;
+			ppu.sprites[BULLET_SPRITE_OFFSET + index].attributes = name_to_index["bullet"] | FACING_UP;
 		else // down
-			ppu.sprites[BULLET_SPRITE_OFFSET + index].index = name_to_index["bullet"] * 4 + 2;
+			ppu.sprites[BULLET_SPRITE_OFFSET + index].attributes = name_to_index["bullet"] | FACING_DOWN;
 	} else if (tank.direction.x == 1) { // right
-		ppu.sprites[BULLET_SPRITE_OFFSET + index].index = name_to_index["bullet"] * 4 + 1;
+		ppu.sprites[BULLET_SPRITE_OFFSET + index].attributes = name_to_index["bullet"] | FACING_RIGHT;
 	} else { // left
-		ppu.sprites[BULLET_SPRITE_OFFSET + index].index = name_to_index["bullet"] * 4 + 3;
+		ppu.sprites[BULLET_SPRITE_OFFSET + index].attributes = name_to_index["bullet"] | FACING_LEFT;
 	}
 
 	bullets[index].pos.x = tank.pos.x;
@@ -442,25 +559,25 @@ void PlayMode::update(float elapsed) {
 	if (left.pressed) {
 		player.direction.x = -1;
 		player.direction.y = 0;
-		ppu.sprites[0].index = name_to_index["player"] + 3;
+		ppu.sprites[0].attributes = name_to_index["player"] | FACING_LEFT;
 		move_tank(player, 0, PlayerSpeed, elapsed);
 	} 
 	else if (right.pressed) {
 		player.direction.x = 1;
 		player.direction.y = 0;
-		ppu.sprites[0].index = name_to_index["player"] + 1;
+		ppu.sprites[0].attributes = name_to_index["player"] | FACING_RIGHT;
 		move_tank(player, 0, PlayerSpeed, elapsed);
 	}
 	else if (down.pressed) {
 		player.direction.x = 0;
 		player.direction.y = -1;
-		ppu.sprites[0].index = name_to_index["player"] + 2;
+		ppu.sprites[0].attributes = name_to_index["player"] | FACING_DOWN;
 		move_tank(player, 0, PlayerSpeed, elapsed);
 	}
 	else if (up.pressed) {
 		player.direction.x = 0;
 		player.direction.y = 1;
-		ppu.sprites[0].index = name_to_index["player"];
+		ppu.sprites[0].attributes = name_to_index["player"] | FACING_UP;
 		move_tank(player, 0, PlayerSpeed, elapsed);
 	}
 
@@ -491,19 +608,19 @@ void PlayMode::update(float elapsed) {
 			if (randint == 0) { // up
 				enemies[i].direction.x = 0;
 				enemies[i].direction.y = 1;
-				ppu.sprites[i+ENEMY_SPRITE_OFFSET].index = name_to_index["enemy"]*4;
+				ppu.sprites[i+ENEMY_SPRITE_OFFSET].attributes = name_to_index["enemy"] | FACING_UP;
 			} else if (randint == 1) { // right
 				enemies[i].direction.x = 1;
 				enemies[i].direction.y = 0;
-				ppu.sprites[i+ENEMY_SPRITE_OFFSET].index = name_to_index["enemy"]*4 + 1;
+				ppu.sprites[i+ENEMY_SPRITE_OFFSET].attributes = name_to_index["enemy"] | FACING_RIGHT;
 			} else if (randint == 1) { // down
 				enemies[i].direction.x = 0;
 				enemies[i].direction.y = -1;
-				ppu.sprites[i+ENEMY_SPRITE_OFFSET].index = name_to_index["enemy"]*4 + 2;
+				ppu.sprites[i+ENEMY_SPRITE_OFFSET].attributes = name_to_index["enemy"] | FACING_DOWN;
 			} else { // left
 				enemies[i].direction.x = -1;
 				enemies[i].direction.y = 0;
-				ppu.sprites[i+ENEMY_SPRITE_OFFSET].index = name_to_index["enemy"]*4 + 3;
+				ppu.sprites[i+ENEMY_SPRITE_OFFSET].attributes = name_to_index["enemy"] | FACING_LEFT;
 			}
 		}
 
@@ -565,13 +682,11 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 	}
 
 	//player sprite:
-	ppu.sprites[0].x = int32_t(player.pos.x);
-	ppu.sprites[0].y = int32_t(player.pos.y);
+	place_sprite(0, int32_t(player.pos.x), int32_t(player.pos.y));
 
 	//enemy sprites:
 	for (size_t i = 0; i < enemies.size(); ++i) {
-		ppu.sprites[ENEMY_SPRITE_OFFSET+i].x = enemies[i].pos.x;
-		ppu.sprites[ENEMY_SPRITE_OFFSET+i].y = enemies[i].pos.y;
+		place_sprite(ENEMY_SPRITE_OFFSET+i, enemies[i].pos.x, enemies[i].pos.y);
 	}
 
 	//bullet sprites:
@@ -585,8 +700,7 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 			bullets[i].pos.y = 255;
 		}
 
-		ppu.sprites[BULLET_SPRITE_OFFSET+i].x = bullets[i].pos.x;
-		ppu.sprites[BULLET_SPRITE_OFFSET+i].y = bullets[i].pos.y;
+		place_sprite(BULLET_SPRITE_OFFSET+i, bullets[i].pos.x, bullets[i].pos.y);
 	}
 
 	//--- actually draw ---
@@ -3,6 +3,8 @@
 
 #include <glm/glm.hpp>
 
+#include <array>
+#include <limits>
 #include <vector>
 #include <deque>
 
@@ -52,15 +54,55 @@ struct PlayMode : Mode {
 
 	bool game_over = false;
 
+	//uniform grid of 8x8-pixel cells over sprite positions, so collision checks only look at nearby sprites:
+	// (each tracked sprite is filed under the cell containing its (x,y) corner)
+	struct SpriteGrid {
+		static constexpr uint32_t CellSize = 8;
+		//enough cells to cover every possible sprite coordinate:
+		static constexpr uint32_t Width = (uint32_t(std::numeric_limits< PPU466::SpriteCoordinate >::max()) + 1) / CellSize;
+		static constexpr uint32_t Height = Width;
+		static constexpr uint16_t None = 0xffff;
+
+		//start over, tracking sprites [0,count) (all at 'sprites' positions):
+		void reset(decltype(PPU466::sprites) const &sprites, size_t count);
+		//move sprite 'index' to (x,y), re-filing it only if its cell changed:
+		void place(size_t index, PPU466::SpriteCoordinate x, PPU466::SpriteCoordinate y);
+		//call f(index) for every tracked sprite whose corner is within 'width' of pos (and some a bit further):
+		template< typename F >
+		void for_each_near(glm::vec2 pos, int width, F &&f) const;
+
+		//each cell is a doubly-linked list of sprite indices:
+		std::array< uint16_t, Width * Height > cell_first;
+		std::vector< uint16_t > cell_of; //cell index per sprite
+		std::vector< uint16_t > next, prev; //neighbors in their cell's list (or None)
+	} sprite_grid;
+
+	//move a sprite, keeping sprite_grid in sync:
+	void place_sprite(size_t index, PPU466::SpriteCoordinate x, PPU466::SpriteCoordinate y);
+
+	//background collision data, kept apart from the (render-format) ppu.background:
+	// solid_rows[y] has bit x set when background tile (x,y) is solid
+	static_assert(PPU466::BackgroundWidth <= 64, "a background row fits in a uint64_t");
+	std::array< uint64_t, PPU466::BackgroundHeight > solid_rows;
+	// solid_masks[y * BackgroundWidth + x] has bit 8v+u set when pixel (u,v) of background tile (x,y) is opaque (and the tile is solid)
+	std::array< uint64_t, PPU466::BackgroundWidth * PPU466::BackgroundHeight > solid_masks;
+	// when set, walls only block where their tiles have opaque pixels (rather than over their whole 8x8 tile):
+	bool pixel_accurate_walls = false;
+
+	//change a background tile, keeping the collision data in sync:
+	void set_background(size_t index, uint16_t value);
+	//recompute all the collision data from ppu.background and ppu.tile_table (after changing them directly):
+	void rebuild_collision_map();
+
 	// helper functions
 	void initialize_level(int level);
 
 	bool hit_by_bullet(int collision_index, Tank &player, 
-			std::array<PPU466::Sprite, 64> &sprites, 
+			decltype(PPU466::sprites) &sprites, 
 			std::vector<Tank>&enemies);
 
 	int check_collision(glm::vec2 sprite, size_t sprite_index, 
-				        std::array<PPU466::Sprite, 64> *sprites, int width);
+				        decltype(PPU466::sprites) *sprites, int width);
 
 
 	void move_tank(Tank &tank, int index, float speed, float elapsed);
@@ -0,0 +1,38 @@
+#include "allocation_count.hpp"
+
+#ifdef PPU466_CHECK_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+//NOTE: these replacements live in their own translation unit so the compiler can't see
+// (and complain about) operator delete being implemented with free()
+
+static std::atomic< uint64_t > count(0);
+
+void *operator new(std::size_t size) {
+	count.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+uint64_t allocation_count() {
+	return count.load(std::memory_order_relaxed);
+}
+
+#else
+
+uint64_t allocation_count() {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+
+//Returns the number of (C++) heap allocations made by the program so far.
+// Counting is only done in builds compiled with -DPPU466_CHECK_ALLOCATIONS
+//  (which replace the global operator new); otherwise this always returns 0.
+// PPU466::draw uses this to verify that steady-state frames don't allocate.
+uint64_t allocation_count();
@@ -1,9 +1,18 @@
 #include "gl_compile_program.hpp"
 
+#include "data_path.hpp"
+#include "read_write_chunk.hpp"
+
+#include <SDL.h>
+
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 
 static GLuint gl_compile_shader(GLenum type, std::string const &source) {
 	GLuint shader = glCreateShader(type);
@@ -27,11 +36,149 @@ static GLuint gl_compile_shader(GLenum type, std::string const &source) {
 	return shader;
 }
 
+//------ program binary cache ------
+//Linking from source can take a noticeable amount of time (especially on a driver's first run), so linked programs
+// are saved next to the executable with glGetProgramBinary and re-loaded with glProgramBinary on later runs.
+//Program binaries are core in OpenGL 4.1 (and otherwise come from GL_ARB_get_program_binary), so they
+// aren't in GL.hpp's OpenGL 3.3 list and their entry points are looked up here.
+//A cache that is missing, damaged, or made by a different driver is never an error -- the program just gets
+// compiled from source (and the cache gets re-written).
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+namespace {
+	typedef void (APIENTRY *GetProgramBinaryFn)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+	typedef void (APIENTRY *ProgramBinaryFn)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+	typedef void (APIENTRY *ProgramParameteriFn)(GLuint program, GLenum pname, GLint value);
+
+	struct ProgramBinaryAPI {
+		GetProgramBinaryFn GetProgramBinary = nullptr;
+		ProgramBinaryFn ProgramBinary = nullptr;
+		ProgramParameteriFn ProgramParameteri = nullptr;
+		bool supported = false;
+	};
+
+	//looked up the first time a program is compiled (i.e., once there is a context):
+	ProgramBinaryAPI const &program_binary_api() {
+		static ProgramBinaryAPI api = [](){
+			ProgramBinaryAPI ret;
+
+			GLint major = 0, minor = 0;
+			glGetIntegerv(GL_MAJOR_VERSION, &major);
+			glGetIntegerv(GL_MINOR_VERSION, &minor);
+			bool core = (major > 4 || (major == 4 && minor >= 1));
+			if (!core && !SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) return ret;
+
+			ret.GetProgramBinary = reinterpret_cast< GetProgramBinaryFn >(SDL_GL_GetProcAddress("glGetProgramBinary"));
+			ret.ProgramBinary = reinterpret_cast< ProgramBinaryFn >(SDL_GL_GetProcAddress("glProgramBinary"));
+			ret.ProgramParameteri = reinterpret_cast< ProgramParameteriFn >(SDL_GL_GetProcAddress("glProgramParameteri"));
+			if (!ret.GetProgramBinary || !ret.ProgramBinary || !ret.ProgramParameteri) return ret;
+
+			//some drivers expose the functions but support no formats (so nothing could ever be saved):
+			GLint formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			ret.supported = (formats > 0);
+			return ret;
+		}();
+		return api;
+	}
+
+	//FNV-1a, over the sources and everything that identifies the driver (binaries are only valid for the driver that made them):
+	uint64_t program_cache_key(std::string const &vertex_shader_source, std::string const &fragment_shader_source) {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		auto add = [&hash](char const *str, size_t length) {
+			for (size_t i = 0; i < length; ++i) {
+				hash = (hash ^ uint8_t(str[i])) * 0x100000001b3ULL;
+			}
+			hash = (hash ^ 0xff) * 0x100000001b3ULL; //(separator, so "ab"+"c" and "a"+"bc" differ)
+		};
+		add(vertex_shader_source.c_str(), vertex_shader_source.size());
+		add(fragment_shader_source.c_str(), fragment_shader_source.size());
+		for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION}) {
+			char const *str = reinterpret_cast< char const * >(glGetString(name));
+			if (!str) str = "";
+			add(str, std::strlen(str));
+		}
+		return hash;
+	}
+
+	std::string program_cache_path(uint64_t key) {
+		char hex[17];
+		std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+		return data_path(std::string("program-cache-") + hex + ".bin");
+	}
+
+	//Cache file format (read_write_chunk.hpp chunks):
+	// 'pgmk' - uint32_t: key (low bits, high bits), binary format
+	// 'pgmb' - uint8_t: the program binary
+
+	//returns a linked program, or 0 if the cache didn't have a (working) one:
+	GLuint load_cached_program(uint64_t key) {
+		std::vector< uint32_t > header;
+		std::vector< uint8_t > binary;
+		try {
+			std::ifstream file(program_cache_path(key), std::ios::binary);
+			if (!file) return 0; //(not cached yet -- the usual first-run case)
+			read_chunk(file, "pgmk", &header);
+			read_chunk(file, "pgmb", &binary);
+		} catch (std::exception const &e) {
+			std::cerr << "WARNING: ignoring damaged program cache '" << program_cache_path(key) << "': " << e.what() << std::endl;
+			return 0;
+		}
+		if (header.size() != 3 || header[0] != uint32_t(key) || header[1] != uint32_t(key >> 32) || binary.empty()) {
+			std::cerr << "WARNING: ignoring mismatched program cache '" << program_cache_path(key) << "'." << std::endl;
+			return 0;
+		}
+
+		GLuint program = glCreateProgram();
+		program_binary_api().ProgramBinary(program, GLenum(header[2]), binary.data(), GLsizei(binary.size()));
+		GLint link_status = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+		if (link_status != GL_TRUE) {
+			//(drivers reject binaries after updates, among other reasons)
+			glDeleteProgram(program);
+			glGetError(); //(glProgramBinary may flag GL_INVALID_ENUM for an unknown format; don't let GL_ERRORS() find it later)
+			return 0;
+		}
+		return program;
+	}
+
+	void save_cached_program(uint64_t key, GLuint program) {
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) return;
+
+		std::vector< uint8_t > binary(length);
+		GLenum format = 0;
+		GLsizei written = 0;
+		program_binary_api().GetProgramBinary(program, length, &written, &format, binary.data());
+		if (written <= 0) return;
+		binary.resize(written);
+
+		std::vector< uint32_t > header{ uint32_t(key), uint32_t(key >> 32), uint32_t(format) };
+		std::ofstream file(program_cache_path(key), std::ios::binary);
+		write_chunk("pgmk", header, &file);
+		write_chunk("pgmb", binary, &file);
+		if (!file) {
+			std::cerr << "WARNING: failed to write program cache '" << program_cache_path(key) << "'." << std::endl;
+		}
+	}
+}
+
 GLuint gl_compile_program(
 	std::string const &vertex_shader_source,
 	std::string const &fragment_shader_source
 	) {
 
+	bool use_cache = program_binary_api().supported;
+	uint64_t key = 0;
+	if (use_cache) {
+		key = program_cache_key(vertex_shader_source, fragment_shader_source);
+		if (GLuint program = load_cached_program(key)) return program;
+	}
+
 	GLuint vertex_shader = gl_compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
 	GLuint fragment_shader = gl_compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
 
@@ -43,6 +190,11 @@ GLuint gl_compile_program(
 	glDeleteShader(vertex_shader);
 	glDeleteShader(fragment_shader);
 
+	//ask the driver to keep the binary around for save_cached_program:
+	if (use_cache) {
+		program_binary_api().ProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
 	//link the shader program and throw errors if linking fails:
 	glLinkProgram(program);
 	GLint link_status = GL_FALSE;
@@ -58,5 +210,9 @@ GLuint gl_compile_program(
 		throw std::runtime_error("failed to link program");
 	}
 
+	if (use_cache) {
+		save_cached_program(key, program);
+	}
+
 	return program;
 }
@@ -6,6 +6,8 @@
 
 //compiles+links an OpenGL shader program from source.
 // throws on compilation error.
+//when the driver supports program binaries, linked programs are cached in data_path("program-cache-*.bin")
+// (keyed by the sources and the driver), so later runs can skip compiling; delete those files to clear the cache.
 GLuint gl_compile_program(
 	std::string const &vertex_shader_source,
 	std::string const &fragment_shader_source);
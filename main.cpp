@@ -11,7 +11,7 @@
 #include "GL.hpp"
 
 //for screenshots:
-#include "load_save_png.hpp"
+#include "AsyncScreenshot.hpp"
 
 //Includes for libSDL:
 #include <SDL.h>
@@ -53,7 +53,7 @@ int main(int argc, char **argv) {
 		"gp20 game1: Battle City", //TODO: remember to set a title for your game!
 		SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
 		2*PPU466::ScreenWidth + 8, 2*PPU466::ScreenHeight + 8, //TODO: modify window size if you'd like
-		SDL_WINDOW_OPENGLe
+		SDL_WINDOW_OPENGL
 		| SDL_WINDOW_RESIZABLE //uncomment to allow resizing
 		| SDL_WINDOW_ALLOW_HIGHDPI //uncomment for full resolution on high-DPI screens
 	);
@@ -97,6 +97,9 @@ int main(int argc, char **argv) {
 
 	//------------ main loop ------------
 
+	//screenshots are read back and saved in the background (see AsyncScreenshot.hpp):
+	AsyncScreenshot screenshots;
+
 	//this inline function will be called whenever the window is resized,
 	// and will update the window_size and drawable_size variables:
 	glm::uvec2 window_size; //size of window (layout pixels)
@@ -108,7 +111,7 @@ int main(int argc, char **argv) {
 		window_size = glm::uvec2(w, h);
 		SDL_GL_GetDrawableSize(window, &w, &h);
 		drawable_size = glm::uvec2(w, h);
-		glViewport(0, 0, drawable_size.x, drawable_size.y);
+		cached_glViewport(0, 0, drawable_size.x, drawable_size.y); //(goes through the GL state cache so drawing code can rely on it)
 	};
 	on_resize();
 
@@ -134,16 +137,9 @@ int main(int argc, char **argv) {
 					// --- screenshot key ---
 					std::string filename = "screenshot.png";
 					std::cout << "Saving screenshot to '" << filename << "'." << std::endl;
-					glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-					glReadBuffer(GL_FRONT);
 					int w,h;
 					SDL_GL_GetDrawableSize(window, &w, &h);
-					std::vector< glm::u8vec4 > data(w*h);
-					glReadPixels(0,0,w,h, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
-					for (auto &px : data) {
-						px.a = 0xff;
-					}
-					save_png(filename, glm::uvec2(w,h), data.data(), LowerLeftOrigin);
+					screenshots.capture(filename, glm::uvec2(w,h), GL_FRONT);
 				}
 			}
 			if (!Mode::current) break;
@@ -170,11 +166,17 @@ int main(int argc, char **argv) {
 
 		//Wait until the recently-drawn frame is shown before doing it all again:
 		SDL_GL_SwapWindow(window);
+
+		//pass along any screenshots the GPU has finished reading back:
+		screenshots.update();
 	}
 
 
 	//------------  teardown ------------
 
+	//(saves any screenshots still in flight, while the context is still around to read them back)
+	screenshots.finish();
+
 	SDL_GL_DeleteContext(context);
 	context = 0;
 
@@ -35,7 +35,7 @@ void read_chunk(std::istream &from, std::string const &magic, std::vector< T > *
 	}
 
 	to.resize(header.size / sizeof(T));
-	if (!from.read(reinterpret_cast< char * >(&to[0]), to.size() * sizeof(T))) {
+	if (!from.read(reinterpret_cast< char * >(to.data()), to.size() * sizeof(T))) { //(to.data() rather than &to[0], since the chunk may be empty)
 		throw std::runtime_error("Failed to read chunk data.");
 	}
 }
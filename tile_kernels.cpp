@@ -0,0 +1,256 @@
+#include "tile_kernels.hpp"
+
+#include <cstring>
+
+#if !defined(TILE_KERNELS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TILE_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if !defined(TILE_KERNELS_NO_SIMD) && defined(__AVX2__)
+#define TILE_KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(PPU466::Tile) == 16, "Tile kernels treat a tile as 8 bytes of bit0 rows followed by 8 bytes of bit1 rows.");
+
+//-------------------------------------------------------------------
+//Scalar versions:
+
+namespace {
+
+	[[maybe_unused]] void tile_expand_scalar(PPU466::Tile const &tile, uint8_t *indices, size_t stride) {
+		for (uint32_t y = 0; y < 8; ++y) {
+			uint64_t row = tile_row_indices(tile, y);
+			for (uint32_t x = 0; x < 8; ++x) {
+				indices[y * stride + x] = uint8_t(row >> (8 * x));
+			}
+		}
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_rotate90_scalar(PPU466::Tile const &tile) {
+		//new row y, bit x comes from old row x, bit (7-y):
+		PPU466::Tile ret;
+		for (uint32_t y = 0; y < 8; ++y) {
+			uint8_t bit0 = 0, bit1 = 0;
+			for (uint32_t x = 0; x < 8; ++x) {
+				bit0 |= ((tile.bit0[x] >> (7 - y)) & 1) << x;
+				bit1 |= ((tile.bit1[x] >> (7 - y)) & 1) << x;
+			}
+			ret.bit0[y] = bit0;
+			ret.bit1[y] = bit1;
+		}
+		return ret;
+	}
+
+	//reverse the bits in each byte of a 64-bit value (swap nibbles, then pairs, then single bits):
+	[[maybe_unused]] uint64_t reverse_bits_in_bytes(uint64_t v) {
+		v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+		v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+		v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+		return v;
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_flip_horizontal_scalar(PPU466::Tile const &tile) {
+		uint64_t planes[2];
+		std::memcpy(planes, &tile, sizeof(planes));
+		planes[0] = reverse_bits_in_bytes(planes[0]);
+		planes[1] = reverse_bits_in_bytes(planes[1]);
+		PPU466::Tile ret;
+		std::memcpy(&ret, planes, sizeof(planes));
+		return ret;
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_flip_vertical_scalar(PPU466::Tile const &tile) {
+		PPU466::Tile ret;
+		for (uint32_t y = 0; y < 8; ++y) {
+			ret.bit0[y] = tile.bit0[7 - y];
+			ret.bit1[y] = tile.bit1[7 - y];
+		}
+		return ret;
+	}
+
+}
+
+//-------------------------------------------------------------------
+//SSE2 versions:
+
+#ifdef TILE_KERNELS_SSE2
+namespace {
+
+	inline __m128i load_tile(PPU466::Tile const &tile) {
+		return _mm_loadu_si128(reinterpret_cast< __m128i const * >(&tile));
+	}
+
+	inline PPU466::Tile store_tile(__m128i v) {
+		PPU466::Tile ret;
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(&ret), v);
+		return ret;
+	}
+
+	//byte i of the mask is (1 << (i % 8)), so comparing a broadcast row against it tests each pixel's bit:
+	inline __m128i pixel_bits_128() {
+		return _mm_set_epi8(
+			-128, 64, 32, 16, 8, 4, 2, 1,
+			-128, 64, 32, 16, 8, 4, 2, 1
+		);
+	}
+
+	//given two bitplane rows broadcast to the two halves of a register, compute their 16 color indices:
+	inline __m128i expand_rows_sse2(__m128i bit0_rows, __m128i bit1_rows) {
+		const __m128i bits = pixel_bits_128();
+		__m128i set0 = _mm_cmpeq_epi8(_mm_and_si128(bit0_rows, bits), bits); //0xff where bit0 is set
+		__m128i set1 = _mm_cmpeq_epi8(_mm_and_si128(bit1_rows, bits), bits); //0xff where bit1 is set
+		return _mm_or_si128(
+			_mm_and_si128(set0, _mm_set1_epi8(1)),
+			_mm_and_si128(set1, _mm_set1_epi8(2))
+		);
+	}
+
+	inline void store_rows(uint8_t *indices, size_t stride, uint32_t y, __m128i rows) {
+		_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + y * stride), rows);
+		_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + (y + 1) * stride), _mm_srli_si128(rows, 8));
+	}
+
+	[[maybe_unused]] void tile_expand_sse2(PPU466::Tile const &tile, uint8_t *indices, size_t stride) {
+		__m128i v = load_tile(tile);
+		//broadcast each row byte to eight bytes by repeated self-unpacking:
+		__m128i bit0_x2 = _mm_unpacklo_epi8(v, v); //bit0 rows 0-7, each repeated twice
+		__m128i bit1_x2 = _mm_unpackhi_epi8(v, v); //bit1 rows 0-7, each repeated twice
+		__m128i bit0_lo_x4 = _mm_unpacklo_epi16(bit0_x2, bit0_x2); //rows 0-3, x4
+		__m128i bit0_hi_x4 = _mm_unpackhi_epi16(bit0_x2, bit0_x2); //rows 4-7, x4
+		__m128i bit1_lo_x4 = _mm_unpacklo_epi16(bit1_x2, bit1_x2);
+		__m128i bit1_hi_x4 = _mm_unpackhi_epi16(bit1_x2, bit1_x2);
+
+		store_rows(indices, stride, 0, expand_rows_sse2(_mm_unpacklo_epi32(bit0_lo_x4, bit0_lo_x4), _mm_unpacklo_epi32(bit1_lo_x4, bit1_lo_x4)));
+		store_rows(indices, stride, 2, expand_rows_sse2(_mm_unpackhi_epi32(bit0_lo_x4, bit0_lo_x4), _mm_unpackhi_epi32(bit1_lo_x4, bit1_lo_x4)));
+		store_rows(indices, stride, 4, expand_rows_sse2(_mm_unpacklo_epi32(bit0_hi_x4, bit0_hi_x4), _mm_unpacklo_epi32(bit1_hi_x4, bit1_hi_x4)));
+		store_rows(indices, stride, 6, expand_rows_sse2(_mm_unpackhi_epi32(bit0_hi_x4, bit0_hi_x4), _mm_unpackhi_epi32(bit1_hi_x4, bit1_hi_x4)));
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_rotate90_sse2(PPU466::Tile const &tile) {
+		//new row y, bit x comes from old row x, bit (7-y):
+		// shifting every byte left by y moves bit (7-y) to the top, where movemask gathers it from all sixteen rows at once.
+		// (16-bit shifts are fine: bits that cross into the high byte of a lane only land below its top bit)
+		__m128i v = load_tile(tile);
+		PPU466::Tile ret;
+		for (uint32_t y = 0; y < 8; ++y) {
+			int mask = _mm_movemask_epi8(_mm_sll_epi16(v, _mm_cvtsi32_si128(int(y))));
+			ret.bit0[y] = uint8_t(mask);
+			ret.bit1[y] = uint8_t(mask >> 8);
+		}
+		return ret;
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_flip_horizontal_sse2(PPU466::Tile const &tile) {
+		//reverse the bits in all sixteen rows at once (swap nibbles, then pairs, then single bits):
+		__m128i v = load_tile(tile);
+		const __m128i m4 = _mm_set1_epi8(0x0f);
+		const __m128i m2 = _mm_set1_epi8(0x33);
+		const __m128i m1 = _mm_set1_epi8(0x55);
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), m4), _mm_slli_epi16(_mm_and_si128(v, m4), 4));
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m2), _mm_slli_epi16(_mm_and_si128(v, m2), 2));
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 1), m1), _mm_slli_epi16(_mm_and_si128(v, m1), 1));
+		return store_tile(v);
+	}
+
+	[[maybe_unused]] PPU466::Tile tile_flip_vertical_sse2(PPU466::Tile const &tile) {
+		//reverse the row order within each bitplane: reverse the 16-bit words in each half, then swap the bytes in each word:
+		__m128i v = load_tile(tile);
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		return store_tile(v);
+	}
+
+}
+#endif //TILE_KERNELS_SSE2
+
+//-------------------------------------------------------------------
+//AVX2 versions:
+
+#ifdef TILE_KERNELS_AVX2
+namespace {
+
+	[[maybe_unused]] void tile_expand_avx2(PPU466::Tile const &tile, uint8_t *indices, size_t stride) {
+		//both bitplanes, in both 128-bit lanes:
+		__m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast< __m128i const * >(&tile)));
+
+		//byte shuffles that broadcast each row byte to eight bytes, four rows per register:
+		// (shuffles work within 128-bit lanes, so the low lane gets rows 0-1 [4-5] and the high lane rows 2-3 [6-7])
+		const __m256i rows_0123 = _mm256_setr_epi8(
+			0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1,
+			2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3
+		);
+		const __m256i rows_4567 = _mm256_add_epi8(rows_0123, _mm256_set1_epi8(4));
+		const __m256i bit1_offset = _mm256_set1_epi8(8); //bit1 rows follow bit0 rows
+
+		const __m256i bits = _mm256_setr_epi8(
+			1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+			1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128
+		);
+		auto expand = [&](__m256i rows) {
+			__m256i bit0 = _mm256_shuffle_epi8(v, rows);
+			__m256i bit1 = _mm256_shuffle_epi8(v, _mm256_add_epi8(rows, bit1_offset));
+			__m256i set0 = _mm256_cmpeq_epi8(_mm256_and_si256(bit0, bits), bits);
+			__m256i set1 = _mm256_cmpeq_epi8(_mm256_and_si256(bit1, bits), bits);
+			return _mm256_or_si256(
+				_mm256_and_si256(set0, _mm256_set1_epi8(1)),
+				_mm256_and_si256(set1, _mm256_set1_epi8(2))
+			);
+		};
+
+		auto store = [&](uint32_t y, __m256i four_rows) {
+			__m128i lo = _mm256_castsi256_si128(four_rows);
+			__m128i hi = _mm256_extracti128_si256(four_rows, 1);
+			_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + (y + 0) * stride), lo);
+			_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + (y + 1) * stride), _mm_srli_si128(lo, 8));
+			_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + (y + 2) * stride), hi);
+			_mm_storel_epi64(reinterpret_cast< __m128i * >(indices + (y + 3) * stride), _mm_srli_si128(hi, 8));
+		};
+
+		store(0, expand(rows_0123));
+		store(4, expand(rows_4567));
+	}
+
+}
+#endif //TILE_KERNELS_AVX2
+
+//-------------------------------------------------------------------
+//Dispatch:
+
+void tile_expand(PPU466::Tile const &tile, uint8_t *indices, size_t stride) {
+#if defined(TILE_KERNELS_AVX2)
+	tile_expand_avx2(tile, indices, stride);
+#elif defined(TILE_KERNELS_SSE2)
+	tile_expand_sse2(tile, indices, stride);
+#else
+	tile_expand_scalar(tile, indices, stride);
+#endif
+}
+
+//(rotation and flips only touch sixteen bytes, so AVX2 has nothing to add over SSE2 for them)
+
+PPU466::Tile tile_rotate90(PPU466::Tile const &tile) {
+#if defined(TILE_KERNELS_SSE2)
+	return tile_rotate90_sse2(tile);
+#else
+	return tile_rotate90_scalar(tile);
+#endif
+}
+
+PPU466::Tile tile_flip_horizontal(PPU466::Tile const &tile) {
+#if defined(TILE_KERNELS_SSE2)
+	return tile_flip_horizontal_sse2(tile);
+#else
+	return tile_flip_horizontal_scalar(tile);
+#endif
+}
+
+PPU466::Tile tile_flip_vertical(PPU466::Tile const &tile) {
+#if defined(TILE_KERNELS_SSE2)
+	return tile_flip_vertical_sse2(tile);
+#else
+	return tile_flip_vertical_scalar(tile);
+#endif
+}
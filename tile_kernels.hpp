@@ -0,0 +1,48 @@
+#pragma once
+
+//Kernels for preprocessing the PPU466's 8x8 2-bit-per-pixel tiles:
+// the SSE2 and AVX2 versions are picked at compile time when the compiler targets those instruction sets,
+// with portable scalar versions used otherwise.
+// (define TILE_KERNELS_NO_SIMD to always use the scalar versions -- handy for checking the others against)
+
+#include "PPU466.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+//Color indices of one row of a tile, packed into a 64-bit value:
+// bits 8x through 8x+7 hold the color index (0-3) of pixel x.
+// (SWAR: the bits of each bitplane row are spread out to one byte each by a multiply + mask)
+inline uint64_t tile_row_indices(PPU466::Tile const &tile, uint32_t row) {
+	auto spread_bits = [](uint8_t bits) -> uint64_t {
+		uint64_t spread = (uint64_t(bits) * 0x0101010101010101ULL) & 0x8040201008040201ULL; //byte x is now either 0 or (1 << x)
+		return ((spread + 0x7f7f7f7f7f7f7f7fULL) >> 7) & 0x0101010101010101ULL; //byte x is now either 0 or 1
+	};
+	return spread_bits(tile.bit0[row]) | (spread_bits(tile.bit1[row]) << 1);
+}
+
+//Which pixels of a tile are opaque (color index other than 0), packed into a 64-bit value:
+// bit 8y+x is set when pixel (x,y) is opaque.
+inline uint64_t tile_opaque_mask(PPU466::Tile const &tile) {
+	uint64_t mask = 0;
+	for (uint32_t y = 0; y < 8; ++y) {
+		mask |= uint64_t(tile.bit0[y] | tile.bit1[y]) << (8 * y);
+	}
+	return mask;
+}
+
+//Expand a tile's bitplanes into color indices, one byte (0-3) per pixel:
+// pixel (x,y) is written to indices[y * stride + x]
+void tile_expand(PPU466::Tile const &tile, uint8_t *indices, size_t stride);
+
+//Rotate a tile by 90 degrees clockwise (with y pointing up, as on the PPU's screen):
+// pixel (x,y) of the result is pixel (7-y,x) of the input
+PPU466::Tile tile_rotate90(PPU466::Tile const &tile);
+
+//Mirror a tile left-to-right:
+// pixel (x,y) of the result is pixel (7-x,y) of the input
+PPU466::Tile tile_flip_horizontal(PPU466::Tile const &tile);
+
+//Mirror a tile top-to-bottom:
+// pixel (x,y) of the result is pixel (x,7-y) of the input
+PPU466::Tile tile_flip_vertical(PPU466::Tile const &tile);